@@ -1,13 +1,51 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <array>
+#include <type_traits>
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <deque>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <thread>
+#include <condition_variable>
+#include <map>
+#include <random>
+#include <functional>
+#include <cmath>
+#include <sstream>
+#include <new>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
 enum state { Out_Of_Poptart, No_Credit, Has_Credit, Dispenses_Poptart };	// enum variables which hold each state available for the dispenser
 enum stateParameter { No_Of_Poptarts, Credit, Cost_Of_Poptart };	// enum variables which are used to hold data in a vector for each parameter e.g. amount of credit left
+enum stockLevel { Empty_Stock, Low_Stock, Normal_Stock };	// enum variables which hold each inventory bucket tracked by the 'FleetIndex'
+enum dispenserEvent { Insert_Money, Make_Selection, Money_Rejected, Add_Poptart, Dispense, Get_Product };	// enum variables which hold each event a dispenser reports to its listeners
+enum sessionSpan { Call_Span, State_Span, Session_Span };	// enum variables which hold each kind of span recorded by the 'SessionTracer'
+enum invariant { Negative_Credit, Negative_Stock, Dispensing_Nothing, Collected_Poptart_Deleted, Collected_Poptart_Reclaimed };	// enum variables which hold each invariant checked by the 'StateExplorer'
 
 class StateContext;
+class FleetIndex;
+struct PriceTable;
+class Poptart_Dispenser;
+
+// links a 'StateContext' into one of the lists kept by the 'FleetIndex'
+// the links live inside the context itself so moving between lists needs no allocation
+struct FleetLink
+{
+	StateContext* previous = nullptr;	// previous context in the same list, nullptr if this is the first
+	StateContext* next = nullptr;		// next context in the same list, nullptr if this is the last
+	int list = -1;						// the state or stock level of the list this context is in, -1 if it isn't in one
+};
 
 class State
 {
@@ -32,6 +70,12 @@ protected:
 	int stateIndex = 0;				// specifies which state the dispenser is currently in e.g. 1 = No_Credit
 	vector<State*> availableStates;	// creates a vector of pointers to states that are available in the CurrentContext
 	vector<int> stateParameters;	// creates a vector of integers which holds data for each stateParameter using the enum as it's index
+	FleetIndex* Fleet = nullptr;	// pointer to the 'FleetIndex' this context has joined initialised to nullptr (not part of a fleet)
+	FleetLink stateLink;			// links this context into the fleet list for its current state
+	FleetLink stockLink;			// links this context into the fleet list for its current stock level
+	ostream* Output = &cout;		// pointer to the stream the states write their messages to initialised to 'cout'
+
+	friend class FleetIndex;	// allows the FleetIndex class to access the fleet links of this class
 
 public:
 	virtual ~StateContext(void);	// iterates through the available states and deletes the data stored within each state and parameter
@@ -39,10 +83,50 @@ public:
 	virtual int getStateIndex(void);		// returns the current 'stateIndex'
 	virtual void setStateParam(stateParameter SP, int value);	// sets stateParameter 'SP' to the value within the 'value' variable in the vector e.g. storing credits
 	virtual int getStateParam(stateParameter SP);	// returns the current amount stored within the 'SP' parameter (index) within the vector e.g. credit
+	void joinFleet(FleetIndex* fleet);	// adds this context to 'fleet' which then tracks its state and stock level
+	void leaveFleet(void);				// removes this context from the fleet it has joined
+	void setOutput(ostream* out);		// sends messages to 'out', an 'ostream' without a buffer (e.g. 'ostream(nullptr)') discards them
+	ostream& output(void);				// returns the stream messages are sent to
+};
+
+// keeps track of which contexts in a fleet are in each state and stock level
+// 'StateContext::setState' and 'setStateParam' update it as they happen, so asking
+// which dispensers are e.g. 'Out_Of_Poptart' takes time in the number of results
+// rather than polling 'getStateIndex' on every dispenser in the fleet
+// each list is an intrusive doubly linked list so every update is O(1)
+// the index isn't thread safe, contexts in one fleet should be driven from one thread
+class FleetIndex
+{
+	static const int State_Count = Dispenses_Poptart + 1;		// number of states a context can be in
+	static const int Stock_Level_Count = Normal_Stock + 1;	// number of stock levels a context can be at
+
+	StateContext* stateHeads[State_Count] = {};			// first context in the list for each state
+	int stateCounts[State_Count] = {};					// number of contexts in the list for each state
+	StateContext* stockHeads[Stock_Level_Count] = {};	// first context in the list for each stock level
+	int stockCounts[Stock_Level_Count] = {};			// number of contexts in the list for each stock level
+	int lowStockThreshold;								// contexts with this many poptarts or fewer are 'Low_Stock'
+
+	void link(StateContext* context, FleetLink StateContext::* member, StateContext** heads, int* counts, int list);	// adds 'context' to the front of list 'list'
+	void unlink(StateContext* context, FleetLink StateContext::* member, StateContext** heads, int* counts);			// removes 'context' from the list it is in
+	vector<StateContext*> members(StateContext* head, FleetLink StateContext::* member);							// returns every context in the list starting at 'head'
+
+public:
+	FleetIndex(int lowStock);	// constructor which accepts the highest number of poptarts that counts as low stock
+	~FleetIndex(void);			// removes every context still in the fleet
+	void add(StateContext* context);		// adds 'context' to the lists for its current state and stock level
+	void remove(StateContext* context);		// removes 'context' from every list
+	void stateChanged(StateContext* context);				// moves 'context' to the list for its current state
+	void stockChanged(StateContext* context, int poptarts);	// moves 'context' to the list for 'poptarts' stock
+	stockLevel getStockLevel(int poptarts);				// returns the stock level that 'poptarts' falls into
+	int countInState(state fleetState);					// returns the number of contexts in 'fleetState'
+	int countAtStock(stockLevel level);					// returns the number of contexts at stock 'level'
+	vector<StateContext*> inState(state fleetState);	// returns every context in 'fleetState' e.g. every dispenser stuck in 'Has_Credit'
+	vector<StateContext*> atStock(stockLevel level);	// returns every context at stock 'level' e.g. every 'Low_Stock' dispenser
 };
 
 StateContext::~StateContext(void)
 {
+	this->leaveFleet();
 	for (int i = 0; i < this->availableStates.size(); i++) delete this->availableStates[i];
 	this->availableStates.clear();
 	this->stateParameters.clear();
@@ -52,6 +136,7 @@ void StateContext::setState(state newState)
 {
 	this->CurrentState = availableStates[newState];
 	this->stateIndex = newState;
+	if (this->Fleet != nullptr) this->Fleet->stateChanged(this);	// keeps the fleet index up to date with the new state
 	this->CurrentState->transition();
 }
 
@@ -63,6 +148,7 @@ int StateContext::getStateIndex(void)
 void StateContext::setStateParam(stateParameter SP, int value)
 {
 	this->stateParameters[SP] = value;
+	if (SP == No_Of_Poptarts && this->Fleet != nullptr) this->Fleet->stockChanged(this, value);	// keeps the fleet index up to date with the new stock
 }
 
 int StateContext::getStateParam(stateParameter SP)
@@ -70,6 +156,129 @@ int StateContext::getStateParam(stateParameter SP)
 	return this->stateParameters[SP];
 }
 
+void StateContext::setOutput(ostream* out)
+{
+	this->Output = out;
+}
+
+ostream& StateContext::output(void)
+{
+	return *this->Output;
+}
+
+void StateContext::joinFleet(FleetIndex* fleet)
+{
+	this->leaveFleet();	// a context can only be part of one fleet at a time
+	this->Fleet = fleet;
+	if (this->Fleet != nullptr) this->Fleet->add(this);
+}
+
+void StateContext::leaveFleet(void)
+{
+	if (this->Fleet == nullptr) return;
+	this->Fleet->remove(this);
+	this->Fleet = nullptr;
+}
+
+FleetIndex::FleetIndex(int lowStock)
+{
+	lowStockThreshold = lowStock;
+}
+
+FleetIndex::~FleetIndex(void)
+{
+	// contexts can outlive the fleet, so each one is told it is no longer part of it
+	for (int i = 0; i < State_Count; i++)
+	{
+		while (this->stateHeads[i] != nullptr) this->stateHeads[i]->leaveFleet();
+	}
+}
+
+void FleetIndex::link(StateContext* context, FleetLink StateContext::* member, StateContext** heads, int* counts, int list)
+{
+	FleetLink& contextLink = context->*member;
+	contextLink.previous = nullptr;
+	contextLink.next = heads[list];
+	contextLink.list = list;
+	if (heads[list] != nullptr) (heads[list]->*member).previous = context;
+	heads[list] = context;
+	counts[list]++;
+}
+
+void FleetIndex::unlink(StateContext* context, FleetLink StateContext::* member, StateContext** heads, int* counts)
+{
+	FleetLink& contextLink = context->*member;
+	if (contextLink.list < 0) return;	// if 'context' isn't in a list there's nothing to remove
+
+	if (contextLink.previous != nullptr) (contextLink.previous->*member).next = contextLink.next;
+	else heads[contextLink.list] = contextLink.next;	// else 'context' was the first in the list
+	if (contextLink.next != nullptr) (contextLink.next->*member).previous = contextLink.previous;
+
+	counts[contextLink.list]--;
+	contextLink = FleetLink();
+}
+
+vector<StateContext*> FleetIndex::members(StateContext* head, FleetLink StateContext::* member)
+{
+	vector<StateContext*> result;
+	for (StateContext* context = head; context != nullptr; context = (context->*member).next) result.push_back(context);
+	return result;
+}
+
+void FleetIndex::add(StateContext* context)
+{
+	this->link(context, &StateContext::stateLink, this->stateHeads, this->stateCounts, context->getStateIndex());
+	this->link(context, &StateContext::stockLink, this->stockHeads, this->stockCounts, this->getStockLevel(context->getStateParam(No_Of_Poptarts)));
+}
+
+void FleetIndex::remove(StateContext* context)
+{
+	this->unlink(context, &StateContext::stateLink, this->stateHeads, this->stateCounts);
+	this->unlink(context, &StateContext::stockLink, this->stockHeads, this->stockCounts);
+}
+
+void FleetIndex::stateChanged(StateContext* context)
+{
+	if (context->stateLink.list == context->getStateIndex()) return;	// if the state hasn't changed it is already in the right list
+	this->unlink(context, &StateContext::stateLink, this->stateHeads, this->stateCounts);
+	this->link(context, &StateContext::stateLink, this->stateHeads, this->stateCounts, context->getStateIndex());
+}
+
+void FleetIndex::stockChanged(StateContext* context, int poptarts)
+{
+	stockLevel level = this->getStockLevel(poptarts);
+	if (context->stockLink.list == level) return;	// if the stock level hasn't changed it is already in the right list
+	this->unlink(context, &StateContext::stockLink, this->stockHeads, this->stockCounts);
+	this->link(context, &StateContext::stockLink, this->stockHeads, this->stockCounts, level);
+}
+
+stockLevel FleetIndex::getStockLevel(int poptarts)
+{
+	if (poptarts <= 0) return Empty_Stock;
+	if (poptarts <= this->lowStockThreshold) return Low_Stock;
+	return Normal_Stock;
+}
+
+int FleetIndex::countInState(state fleetState)
+{
+	return this->stateCounts[fleetState];
+}
+
+int FleetIndex::countAtStock(stockLevel level)
+{
+	return this->stockCounts[level];
+}
+
+vector<StateContext*> FleetIndex::inState(state fleetState)
+{
+	return this->members(this->stateHeads[fleetState], &StateContext::stateLink);
+}
+
+vector<StateContext*> FleetIndex::atStock(stockLevel level)
+{
+	return this->members(this->stockHeads[level], &StateContext::stockLink);
+}
+
 // used to prevent the user interacting with the dispenser when it's in the transition state
 // all methods return an error message, this is useful to prevent two states being active at once
 // which can cause unexpected errors e.g. in banking applications
@@ -147,6 +356,10 @@ public:
 	bool moneyRejected(void);
 	bool addPoptart(int number);
 	bool dispense(void);
+	void complete(bool success);	// finishes a dispense the actuator has completed, 'success' is false if the hardware failed
+private:
+	void release(void);		// charges the customer and hands the poptart over
+	void leave(void);		// changes to the next state once dispensing has finished
 };
 
 // Superclass for both the 'Bases' and 'Fillings' storing data and the use of the methods for each subclass
@@ -154,12 +367,14 @@ public:
 class Product
 {
 	friend class Filling;	// allows the Filling class to access the private methods and variables of this class
+	friend struct PriceTable;	// allows the PriceTable struct to set the cost to the price quoted when selected
 protected:
 	string product_description;	// description of the poptart base or filling e.g. Chocolate
 	int itemCost = 0;	// cost of the poptart base or filling e.g. 50
 	//virtual Product* ReturnNext(void);
 	//virtual void RemoveHighestCostItem(Product* HighestItem);
 public:
+	virtual ~Product(void) {};	// virtual so a poptart with fillings (e.g. a queued or uncollected order) is deleted through every decorator
 	virtual void consume(void);
 	virtual int cost(void);				// returns the product cost of the specified Base selected
 	virtual string description(void);	// returns the desciption of the specified Base selected
@@ -197,10 +412,13 @@ public:
 class PlainBase : public Poptart
 {
 public:
+	static constexpr const char* itemName = "Plain";	// description available at compile time for the 'Recipe' template
+	static constexpr int itemPrice = 100;			// cost available at compile time for the 'Recipe' template
+	static constexpr int optionCode = 1;			// bit used to select this item in the makeSelection option code
 	PlainBase(void)
 	{
-		this->product_description = "Plain";
-		this->itemCost = 100;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
@@ -208,10 +426,13 @@ public:
 class SpicyBase : public Poptart
 {
 public:
+	static constexpr const char* itemName = "Spicy";
+	static constexpr int itemPrice = 150;
+	static constexpr int optionCode = 2;
 	SpicyBase(void)
 	{
-		this->product_description = "Spicy";
-		this->itemCost = 150;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
@@ -219,10 +440,13 @@ public:
 class ChocolateBase : public Poptart
 {
 public:
+	static constexpr const char* itemName = "Chocolate";
+	static constexpr int itemPrice = 200;
+	static constexpr int optionCode = 4;
 	ChocolateBase(void)
 	{
-		this->product_description = "Chocolate";
-		this->itemCost = 200;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
@@ -230,20 +454,26 @@ public:
 class CoconutBase : public Poptart
 {
 public:
+	static constexpr const char* itemName = "Coconut";
+	static constexpr int itemPrice = 200;
+	static constexpr int optionCode = 8;
 	CoconutBase(void)
 	{
-		this->product_description = "Coconut";
-		this->itemCost = 200;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 // Fruity Base that overrides the description and cost of the Poptart product
 class FruityBase : public Poptart
 {
 public:
+	static constexpr const char* itemName = "Fruity";
+	static constexpr int itemPrice = 200;
+	static constexpr int optionCode = 16;
 	FruityBase(void)
 	{
-		this->product_description = "Fruity";
-		this->itemCost = 200;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
@@ -259,7 +489,7 @@ public:
 	virtual int cost(void);				// returns the current cost plus the cost of the currently selected filling
 	virtual string description(void);	// returns the current Poptart plus the new filling description e.g. Spicy(Base) + Banana(Filling) Poptart
 	void addToPoptart(Product* customerFilling);	// adds the new filling to the current poptart
-	~Filling(void);	// deconstructor that deletes the filling after it finishes executing
+	virtual ~Filling(void);	// deconstructor that deletes the filling after it finishes executing
 
 };
 
@@ -294,20 +524,26 @@ Filling::~Filling(void)
 class ChocolateFilling : public Filling
 {
 public:
+	static constexpr const char* itemName = "Chocolate";
+	static constexpr int itemPrice = 20;
+	static constexpr int optionCode = 32;
 	ChocolateFilling(Product* customerPoptart) : Filling(customerPoptart)
 	{
-		this->product_description = "Chocolate";
-		this->itemCost = 20;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
 class BananaFilling : public Filling
 {
 public:
+	static constexpr const char* itemName = "Banana";
+	static constexpr int itemPrice = 50;
+	static constexpr int optionCode = 64;
 	BananaFilling(Product* customerPoptart) : Filling(customerPoptart)
 	{
-		this->product_description = "Banana";
-		this->itemCost = 50;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
@@ -315,552 +551,3496 @@ public:
 class StrawberryFilling : public Filling
 {
 public:
+	static constexpr const char* itemName = "Strawberry";
+	static constexpr int itemPrice = 50;
+	static constexpr int optionCode = 128;
 	StrawberryFilling(Product* customerPoptart) : Filling(customerPoptart)
 	{
-		this->product_description = "Strawberry";
-		this->itemCost = 50;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
 class RaspberryFilling : public Filling
 {
 public:
+	static constexpr const char* itemName = "Raspberry";
+	static constexpr int itemPrice = 50;
+	static constexpr int optionCode = 256;
 	RaspberryFilling(Product* customerPoptart) : Filling(customerPoptart)
 	{
-		this->product_description = "Raspberry";
-		this->itemCost = 50;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
 class AppleFilling : public Filling
 {
 public:
+	static constexpr const char* itemName = "Apple";
+	static constexpr int itemPrice = 50;
+	static constexpr int optionCode = 512;
 	AppleFilling(Product* customerPoptart) : Filling(customerPoptart)
 	{
-		this->product_description = "Apple";
-		this->itemCost = 50;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
 class BlackberryFilling : public Filling
 {
 public:
+	static constexpr const char* itemName = "Blackberry";
+	static constexpr int itemPrice = 50;
+	static constexpr int optionCode = 1024;
 	BlackberryFilling(Product* customerPoptart) : Filling(customerPoptart)
 	{
-		this->product_description = "Blackberry";
-		this->itemCost = 50;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
 class MapleFilling : public Filling
 {
 public:
+	static constexpr const char* itemName = "Maple";
+	static constexpr int itemPrice = 100;
+	static constexpr int optionCode = 2048;
 	MapleFilling(Product* customerPoptart) : Filling(customerPoptart)
 	{
-		this->product_description = "Maple";
-		this->itemCost = 100;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
 class MarshmellowFilling : public Filling
 {
 public:
+	static constexpr const char* itemName = "Marshmellow";
+	static constexpr int itemPrice = 20;
+	static constexpr int optionCode = 4096;
 	MarshmellowFilling(Product* customerPoptart) : Filling(customerPoptart)
 	{
-		this->product_description = "Marshmellow";
-		this->itemCost = 20;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
 class CheeseFilling : public Filling
 {
 public:
+	static constexpr const char* itemName = "Cheese";
+	static constexpr int itemPrice = 70;
+	static constexpr int optionCode = 8192;
 	CheeseFilling(Product* customerPoptart) : Filling(customerPoptart)
 	{
-		this->product_description = "Cheese";
-		this->itemCost = 70;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
 class CheeseAndHamFilling : public Filling
 {
 public:
+	static constexpr const char* itemName = "Cheese and Ham";
+	static constexpr int itemPrice = 100;
+	static constexpr int optionCode = 16384;
 	CheeseAndHamFilling(Product* customerPoptart) : Filling(customerPoptart)
 	{
-		this->product_description = "Cheese and Ham";
-		this->itemCost = 100;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
 class CaramelFilling : public Filling
 {
 public:
+	static constexpr const char* itemName = "Caramel";
+	static constexpr int itemPrice = 20;
+	static constexpr int optionCode = 32768;
 	CaramelFilling(Product* customerPoptart) : Filling(customerPoptart)
 	{
-		this->product_description = "Caramel";
-		this->itemCost = 20;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
 class VanillaFilling : public Filling
 {
 public:
+	static constexpr const char* itemName = "Vanilla";
+	static constexpr int itemPrice = 50;
+	static constexpr int optionCode = 65536;
 	VanillaFilling(Product* customerPoptart) : Filling(customerPoptart)
 	{
-		this->product_description = "Vanilla";
-		this->itemCost = 50;
+		this->product_description = itemName;
+		this->itemCost = itemPrice;
 	}
 };
 
+// returns the position of the bit used by 'optionCode' e.g. Banana (64) is in position 6
+constexpr int optionSlot(int optionCode)
+{
+	int slot = 0;
+	while (optionCode > 1)
+	{
+		optionCode >>= 1;
+		slot++;
+	}
+	return slot;
+}
 
-class Poptart_Dispenser : public StateContext, public Transition
+// writes the slot of each item selected by the 'option' code into 'slots' in the order they are added
+// to the poptart and returns how many there are, only the first base is used but every filling is added
+// e.g. 1089 gives Plain (0), Banana (6) then Blackberry (10)
+// this is the one place an option code is decoded, both pricing and building a selection use it
+constexpr int selectionSlots(int option, int* slots)
 {
-	friend class DispensesPoptart;	// allows the DispensesPoptart class to access the private methods and variables of this class
-	friend class HasCredit;	// allows the HasCredit class to access the private methods and variables of this class
-private:
-	PoptartState* PoptartCurrentState = nullptr;	// pointer to PoptartState class initialised to nullptr (default values)
-	bool itemDispensed = false;
-	//indicates whether a product is there to be retrieved
-	Product* DispensedItem = nullptr;
-	bool itemRetrieved = false; //indicates whether a product has been retrieved
-public:
-	Poptart_Dispenser(int inventory_count);
-	~Poptart_Dispenser(void);
-	bool insertMoney(int money);
-	bool makeSelection(int option);
-	bool moneyRejected(void);
-	bool addPoptart(int number);
-	bool dispense(void);
-	Product* getProduct(void);
-	virtual void setStateParam(stateParameter SP, int value);
-	virtual int getStateParam(stateParameter SP);
-};
+	int count = 0;
 
-// constructor that is used when the object is initialised using a starting amount of poptarts available for its argument
-Poptart_Dispenser::Poptart_Dispenser(int inventory_count)
+	// BASES
+	for (int slot = 0; slot <= optionSlot(FruityBase::optionCode); slot++)
+	{
+		if (option & (1 << slot))
+		{
+			slots[count++] = slot;
+			break;
+		}
+	}
+
+	// FILLINGS
+	for (int slot = optionSlot(ChocolateFilling::optionCode); slot <= optionSlot(VanillaFilling::optionCode); slot++)
+	{
+		if (option & (1 << slot)) slots[count++] = slot;
+	}
+
+	return count;
+}
+
+// versioned table holding the price of every base and filling
+// each price is stored at the position of the item's bit in the option code
+// e.g. prices[0] is the Plain base (1) and prices[6] is the Banana filling (64)
+struct PriceTable
 {
-	// poptart should start with an inventory count of 0
-	// meaning it starts in the Out_Of_Poptart state
-	// it should then add a poptart which should change the state
-	// based on the current state it is in
+	static const int Item_Count = optionSlot(VanillaFilling::optionCode) + 1;	// number of bases and fillings in the option code
 
-	// add all available states to the 'availableStates' vector
-	this->availableStates.push_back(new OutOfPoptart(this));
-	this->availableStates.push_back(new NoCredit(this));
-	this->availableStates.push_back(new HasCredit(this));
-	this->availableStates.push_back(new DispensesPoptart(this));
+	int version = 0;				// version of the table, 0 is the catalogue price list
+	int prices[Item_Count] = {};	// price of each base and filling
 
-	this->stateParameters.push_back(0);	// No of Poptarts
-	this->stateParameters.push_back(0); // Credit
+	static constexpr PriceTable catalogue(void);			// returns the prices set at compile time in each base and filling
+	constexpr int getPrice(int optionCode) const;			// returns the price of the item selected by 'optionCode'
+	constexpr void setPrice(int optionCode, int price);		// sets the price of the item selected by 'optionCode' e.g. for a promotion
+	constexpr int quote(int option) const;					// returns the price of the poptart selected by 'option' e.g. 1089
+	constexpr int total(const int* slots, int count) const;	// returns the price of the items in the first 'count' 'slots'
+	Product* apply(Product* item, int optionCode) const;	// sets the cost of 'item' to the price in this table
+};
 
-	this->setState(Out_Of_Poptart);	// setting starting state to 'Out_Of_Poptart'
+// constexpr so a 'Recipe' can check its cost against the catalogue at compile time
+constexpr PriceTable PriceTable::catalogue(void)
+{
+	PriceTable table;
+	table.setPrice(PlainBase::optionCode, PlainBase::itemPrice);
+	table.setPrice(SpicyBase::optionCode, SpicyBase::itemPrice);
+	table.setPrice(ChocolateBase::optionCode, ChocolateBase::itemPrice);
+	table.setPrice(CoconutBase::optionCode, CoconutBase::itemPrice);
+	table.setPrice(FruityBase::optionCode, FruityBase::itemPrice);
+	table.setPrice(ChocolateFilling::optionCode, ChocolateFilling::itemPrice);
+	table.setPrice(BananaFilling::optionCode, BananaFilling::itemPrice);
+	table.setPrice(StrawberryFilling::optionCode, StrawberryFilling::itemPrice);
+	table.setPrice(RaspberryFilling::optionCode, RaspberryFilling::itemPrice);
+	table.setPrice(AppleFilling::optionCode, AppleFilling::itemPrice);
+	table.setPrice(BlackberryFilling::optionCode, BlackberryFilling::itemPrice);
+	table.setPrice(MapleFilling::optionCode, MapleFilling::itemPrice);
+	table.setPrice(MarshmellowFilling::optionCode, MarshmellowFilling::itemPrice);
+	table.setPrice(CheeseFilling::optionCode, CheeseFilling::itemPrice);
+	table.setPrice(CheeseAndHamFilling::optionCode, CheeseAndHamFilling::itemPrice);
+	table.setPrice(CaramelFilling::optionCode, CaramelFilling::itemPrice);
+	table.setPrice(VanillaFilling::optionCode, VanillaFilling::itemPrice);
+	return table;
+}
 
-	// if 'inventory_count' (poptarts) are greater than 0 when first initialising
-	// add the poptarts using the 'addPoptart' method which also sets the
-	// state to 'No_Credit'
-	if (inventory_count > 0)
-	{
-		this->addPoptart(inventory_count);
-	}
+constexpr int PriceTable::getPrice(int optionCode) const
+{
+	return this->prices[optionSlot(optionCode)];
 }
 
-// deletes product poptart at end of execution
-Poptart_Dispenser::~Poptart_Dispenser(void)
+constexpr void PriceTable::setPrice(int optionCode, int price)
 {
-	if (!this->itemRetrieved)
-	{
-		delete this->DispensedItem;
-	}
+	this->prices[optionSlot(optionCode)] = price;
 }
 
-// sets the current state to the specified state
-// then calls the insertMoney method which has a different function
-// depending on the current state
-bool Poptart_Dispenser::insertMoney(int money)
+constexpr int PriceTable::quote(int option) const
 {
-	PoptartCurrentState = (PoptartState*) this->CurrentState;
-	return this->PoptartCurrentState->insertMoney(money);
+	int slots[Item_Count] = {};
+	return this->total(slots, selectionSlots(option, slots));
 }
 
-// sets the current state to the specified state
-// then calls the makeSelection method which has a different function
-// depending on the current state
-bool Poptart_Dispenser::makeSelection(int option)
+constexpr int PriceTable::total(const int* slots, int count) const
 {
-	PoptartCurrentState = (PoptartState*) this->CurrentState;
-	return this->PoptartCurrentState->makeSelection(option);
+	int cost = 0;
+	for (int i = 0; i < count; i++) cost += this->prices[slots[i]];
+	return cost;
 }
 
-// sets the current state to the specified state
-// then calls the moneyRejected method which has a different function
-// depending on the current state
-bool Poptart_Dispenser::moneyRejected(void)
+Product* PriceTable::apply(Product* item, int optionCode) const
 {
-	PoptartCurrentState = (PoptartState*) this->CurrentState;
-	return this->PoptartCurrentState->moneyRejected();
+	item->itemCost = this->getPrice(optionCode);
+	return item;
 }
 
-// sets the current state to the specified state
-// then calls the addPoptart method which has a different function
-// depending on the current state
-bool Poptart_Dispenser::addPoptart(int number)
+// holds the price table shared by the dispensers so prices can change at any moment
+// e.g. when a promotion starts across the fleet
+// readers never take a lock, 'read' copies whichever table is current (read-copy-update)
+// and 'publish' swaps in a new table, then frees an old one once no reader can still be copying it
+// (epoch-based reclamation, each reading thread marks the epoch it started reading in)
+class PriceBoard
 {
-	PoptartCurrentState = (PoptartState*) this->CurrentState;
-	return this->PoptartCurrentState->addPoptart(number);
+	static const int Max_Readers = 128;	// number of threads that can read without a lock, any more fall back to the publish lock
+
+	atomic<const PriceTable*> currentTable;				// table readers copy from
+	atomic<unsigned long long> globalEpoch;				// advanced every time a table is published
+	atomic<unsigned long long> readerEpochs[Max_Readers];	// epoch each reading thread started reading in, 0 if it isn't reading
+	mutex publishLock;									// only one admin can publish at a time
+	vector<pair<const PriceTable*, unsigned long long>> retiredTables;	// replaced tables and the epoch they were replaced in
+
+	static int readerSlot(void);	// returns the position in 'readerEpochs' for the calling thread, -1 if there are none left
+	void reclaim(void);				// frees every retired table that no reader can still be copying
+
+public:
+	PriceBoard(void);	// constructor which starts with the catalogue prices
+	~PriceBoard(void);	// frees the current and retired tables
+	PriceTable read(void);				// returns a copy of the current table
+	int publish(PriceTable table);		// replaces the current table with 'table' and returns its version
+	static PriceBoard& fleet(void);		// returns the board shared by every dispenser
+};
+
+PriceBoard::PriceBoard(void)
+{
+	this->currentTable.store(new PriceTable(PriceTable::catalogue()));
+	this->globalEpoch.store(1);
+	for (int i = 0; i < Max_Readers; i++) this->readerEpochs[i].store(0);
 }
 
-// sets the current state to the specified state
-// then calls the dispense method which has a different function
-// depending on the current state
-bool Poptart_Dispenser::dispense(void)
+PriceBoard::~PriceBoard(void)
 {
-	PoptartCurrentState = (PoptartState*) this->CurrentState;
-	return this->PoptartCurrentState->dispense();
+	delete this->currentTable.load();
+	for (int i = 0; i < (int)this->retiredTables.size(); i++) delete this->retiredTables[i].first;
+	this->retiredTables.clear();
 }
 
-Product* Poptart_Dispenser::getProduct(void)
+// each thread is given a free slot the first time it reads and hands it back when the thread exits
+// so threads started for a short piece of work (e.g. a worker pool that restarts its threads) don't use up the slots
+int PriceBoard::readerSlot(void)
 {
-	if (this->itemDispensed)	// if item has been dispensed
+	static atomic<bool> slotsTaken[Max_Readers];
+
+	struct ThreadSlot
 	{
-		this->itemDispensed = false;	// then set itemDispensed back to false
-		this->itemRetrieved = true;		// and item retrieved to true as it has been dispensed
-		return this->DispensedItem;		// return the DispensedItem (Poptart) object
+		int slot = -1;
+		ThreadSlot(void)
+		{
+			for (int i = 0; i < Max_Readers && this->slot < 0; i++)
+			{
+				bool taken = false;
+				if (slotsTaken[i].compare_exchange_strong(taken, true)) this->slot = i;
+			}
+		}
+		~ThreadSlot(void)
+		{
+			if (this->slot >= 0) slotsTaken[this->slot].store(false);
+		}
+	};
+
+	thread_local ThreadSlot current;
+	return current.slot;
+}
+
+PriceTable PriceBoard::read(void)
+{
+	int slot = readerSlot();
+	if (slot < 0)	// if every slot is taken, copy the table under the publish lock instead
+	{
+		lock_guard<mutex> lock(this->publishLock);
+		return *this->currentTable.load();
 	}
 
-	return nullptr;	// else return nullptr
+	// the epoch is marked before the table is loaded so 'publish' can see this
+	// thread may still be copying any table replaced in this epoch or later
+	this->readerEpochs[slot].store(this->globalEpoch.load());
+	PriceTable table = *this->currentTable.load();
+	this->readerEpochs[slot].store(0, memory_order_release);
+	return table;
 }
 
-
-void Poptart_Dispenser::setStateParam(stateParameter SP, int value)
+int PriceBoard::publish(PriceTable table)
 {
-	if (SP == Cost_Of_Poptart) return;	// if StateParameter 'SP' is equal to the StateParameter 'Cost_Of_Poptart' exit method
-	this->stateParameters[SP] = value;	// else stored the cost of the poptart in the vector using the current 'SP' index
+	lock_guard<mutex> lock(this->publishLock);
+
+	table.version = this->currentTable.load()->version + 1;
+	const PriceTable* replaced = this->currentTable.exchange(new PriceTable(table));
+	this->retiredTables.push_back(make_pair(replaced, this->globalEpoch.fetch_add(1)));
+	this->reclaim();
+	return table.version;
 }
 
-int Poptart_Dispenser::getStateParam(stateParameter SP)
+void PriceBoard::reclaim(void)
 {
-	if (SP == Cost_Of_Poptart)	// if StateParameter 'SP' is equal to the StateParameter 'Cost_Of_Poptart'
+	// a retired table is only safe to free once every reader has either
+	// finished reading or started in a later epoch than it was replaced in
+	unsigned long long oldestReader = ~0ULL;
+	for (int i = 0; i < Max_Readers; i++)
 	{
-		if (DispensedItem == nullptr) return 0;	// if 'DispensedItem' is nullptr, return 0
-		return DispensedItem->cost();			// else return the current cost of the 'DispensedItem' poptart
+		unsigned long long epoch = this->readerEpochs[i].load();
+		if (epoch != 0 && epoch < oldestReader) oldestReader = epoch;
 	}
-	return this->stateParameters[SP];	// else return current 'SP' index
+
+	int kept = 0;
+	for (int i = 0; i < (int)this->retiredTables.size(); i++)
+	{
+		if (this->retiredTables[i].second < oldestReader) delete this->retiredTables[i].first;
+		else this->retiredTables[kept++] = this->retiredTables[i];
+	}
+	this->retiredTables.resize(kept);
 }
 
-// OutOfPoptart State
-// Cannot insert money when the current state of 'OutOfPoptarts'
-// insertMoney calls 'moneyRejected' in order to refund credit
-bool OutOfPoptart::insertMoney(int money)
+PriceBoard& PriceBoard::fleet(void)
 {
-	cout << "Error! No poptarts left." << endl;
-	this->moneyRejected();
-	return false;
+	static PriceBoard board;
+	return board;
 }
 
-// Cannot select a poptart as there are no poptarts in the dispenser
-bool OutOfPoptart::makeSelection(int option)
+// returns true if the 'option' code selects one of the bases
+constexpr bool selectsBase(int option)
 {
-	cout << "Error! No poptarts to select from!" << endl;
-	return false;
+	return (option & (PlainBase::optionCode | SpicyBase::optionCode | ChocolateBase::optionCode
+		| CoconutBase::optionCode | FruityBase::optionCode)) != 0;
 }
 
-// No poptarts available therefore credit is rejected when entered
-bool OutOfPoptart::moneyRejected(void)
+// creates the base or filling selected by 'optionCode'
+// a filling is added to 'poptart' using the Decorator Pattern, a base starts a new poptart
+Product* makeItem(int optionCode, Product* poptart)
 {
-	cout << "Refunding credit!" << endl;
-	return true;
+	switch (optionCode)
+	{
+	case PlainBase::optionCode: return new PlainBase();
+	case SpicyBase::optionCode: return new SpicyBase();
+	case ChocolateBase::optionCode: return new ChocolateBase();
+	case CoconutBase::optionCode: return new CoconutBase();
+	case FruityBase::optionCode: return new FruityBase();
+	case ChocolateFilling::optionCode: return new ChocolateFilling(poptart);
+	case BananaFilling::optionCode: return new BananaFilling(poptart);
+	case StrawberryFilling::optionCode: return new StrawberryFilling(poptart);
+	case RaspberryFilling::optionCode: return new RaspberryFilling(poptart);
+	case AppleFilling::optionCode: return new AppleFilling(poptart);
+	case BlackberryFilling::optionCode: return new BlackberryFilling(poptart);
+	case MapleFilling::optionCode: return new MapleFilling(poptart);
+	case MarshmellowFilling::optionCode: return new MarshmellowFilling(poptart);
+	case CheeseFilling::optionCode: return new CheeseFilling(poptart);
+	case CheeseAndHamFilling::optionCode: return new CheeseAndHamFilling(poptart);
+	case CaramelFilling::optionCode: return new CaramelFilling(poptart);
+	case VanillaFilling::optionCode: return new VanillaFilling(poptart);
+	}
+	return nullptr;
 }
 
-// Adds poptarts to the dispenser
-// then changes state to 'No Credit'
-bool OutOfPoptart::addPoptart(int number)
+// builds the poptart selected by the 'option' code using the Decorator Pattern
+// costing each base and filling from 'prices'
+// returns nullptr if 'option' doesn't select a base
+Product* decodeSelection(int option, const PriceTable& prices)
 {
-	this->CurrentContext->setStateParam(No_Of_Poptarts, number);	// inserts poptarts into the vector 'stateParam' using index 'No_Of_Poptarts'
-	this->CurrentContext->setState(No_Credit);	// changes state to 'No_Credit'
-	return true;
+	if (!selectsBase(option)) return nullptr;	// fillings need a base to be added to
+
+	// the base comes first, then each filling is added on top of the poptart so far
+	int slots[PriceTable::Item_Count];
+	int count = selectionSlots(option, slots);
+	Product* poptart = nullptr;
+	for (int i = 0; i < count; i++) poptart = prices.apply(makeItem(1 << slots[i], poptart), 1 << slots[i]);
+	return poptart;
 }
 
-// Cannot dispense as there are no poptarts within the dispenser
-bool OutOfPoptart::dispense(void)
+// returns the number of characters in 'text' at compile time
+constexpr size_t constLength(const char* text)
 {
-	cout << "Error! No poptarts available to dispense." << endl;
-	return false;
+	size_t length = 0;
+	while (text[length] != '\0') length++;
+	return length;
+}
 
+// returns the length of a recipe description e.g. "Plain + Banana" is 14 characters
+template <class Base, class... Fillings>
+constexpr size_t recipeDescriptionLength(void)
+{
+	return constLength(Base::itemName) + (0 + ... + (3 + constLength(Fillings::itemName)));
 }
 
-// NoCredit State
-// Inserts credit to the dispenser
-// then changes state to 'Has Credit'
-bool NoCredit::insertMoney(int money)
+// joins the base and filling names with " + " at compile time
+// giving the same text as 'Filling::description' does at runtime
+template <class Base, class... Fillings>
+constexpr array<char, recipeDescriptionLength<Base, Fillings...>() + 1> recipeDescription(void)
 {
-	cout << "Inserting: " << money;
-	this->CurrentContext->setStateParam(Credit, money);	// inserts credit into the vector 'stateParam' using index 'Credit'
-	cout << "\nNew Total: " << money << endl;
-	this->CurrentContext->setState(Has_Credit);	// changes state to 'Has_Credit'
+	array<char, recipeDescriptionLength<Base, Fillings...>() + 1> text{};
+	const char* names[] = { Base::itemName, Fillings::itemName... };
+	size_t position = 0;
+
+	for (size_t i = 0; i < sizeof...(Fillings) + 1; i++)
+	{
+		if (i > 0)	// every filling is separated from the previous item by " + "
+		{
+			text[position++] = ' ';
+			text[position++] = '+';
+			text[position++] = ' ';
+		}
+		for (const char* letter = names[i]; *letter != '\0'; letter++) text[position++] = *letter;
+	}
+
+	text[position] = '\0';
+	return text;
+}
+
+// returns true if each filling comes after the previous item in the option code
+// 'makeSelection' adds fillings in this order, so a recipe listed in any other
+// order (or with a filling twice) would not match the runtime description
+template <class Base, class... Fillings>
+constexpr bool recipeInOptionOrder(void)
+{
+	const int codes[] = { Base::optionCode, Fillings::optionCode... };
+	for (size_t i = 1; i < sizeof...(Fillings) + 1; i++)
+	{
+		if (codes[i] <= codes[i - 1]) return false;
+	}
 	return true;
 }
 
+// a named preset that can be registered with the dispenser using 'registerPreset'
+// the catalogue cost and description are worked out at compile time by the 'Recipe' template
+// so selecting and dispensing a preset needs no option decoding, heap allocation or virtual calls
+// the poptart itself is still built using 'make' when the customer collects it, so collecting
+// a preset allocates the same decorator chain as any other selection
+struct PresetRecipe
+{
+	const char* name;			// name of the preset e.g. "Berry Banana"
+	int option;					// option code that selects the preset in 'makeSelection' e.g. 1089
+	int slots[PriceTable::Item_Count];	// price table slot of the base and each filling, worked out at compile time
+	int slotCount;				// number of items in 'slots'
+	const char* description;	// description of the base and fillings e.g. Plain + Banana + Blackberry
+	Product* (*make)(const PriceTable& prices);	// builds the poptart using the Decorator Pattern, costing each item from 'prices'
+};
 
-// Cannot make a selection as user
-// has insufficient credit
-bool NoCredit::makeSelection(int option)
+// Recipe template that combines a base with any number of fillings at compile time
+// e.g. Recipe<PlainBase, BananaFilling, BlackberryFilling> is the same poptart as option 1089
+template <class Base, class... Fillings>
+class Recipe
 {
-	cout << "Error! Insufficient credit!" << endl;
-	return false;
-}
+	static_assert(is_base_of<Poptart, Base>::value && !is_base_of<Filling, Base>::value, "Recipe must start with a base");
+	static_assert((is_base_of<Filling, Fillings>::value && ...), "Recipe can only add fillings to the base");
+	static_assert(recipeInOptionOrder<Base, Fillings...>(), "Recipe fillings must be listed once each in option code order");
 
+	static constexpr array<char, recipeDescriptionLength<Base, Fillings...>() + 1> descriptionText = recipeDescription<Base, Fillings...>();
 
-// NOT SURE ON COMMON SENSE
-bool NoCredit::moneyRejected(void)
+public:
+	static constexpr int optionCode(void) { return (Base::optionCode | ... | Fillings::optionCode); }	// returns the option code that selects this recipe
+	static constexpr int cost(void) { return (Base::itemPrice + ... + Fillings::itemPrice); }			// returns the catalogue cost of the base plus every filling
+	static constexpr const char* description(void) { return descriptionText.data(); }					// returns the description e.g. Plain + Banana
+	static Product* make(const PriceTable& prices);														// builds the poptart from the base and fillings
+	static constexpr PresetRecipe preset(const char* name);												// returns the recipe as a named preset
+};
+
+template <class Base, class... Fillings>
+Product* Recipe<Base, Fillings...>::make(const PriceTable& prices)
 {
-	cout << "Error! Cannot reject credit in this state!" << endl;
-	return false;
+	Product* poptart = prices.apply(new Base(), Base::optionCode);						// start with the base
+	((poptart = prices.apply(new Fillings(poptart), Fillings::optionCode)), ...);		// then decorate it with each filling in order
+	return poptart;
 }
 
-// Cannot add poptarts from this state
-// as dispenser already contains poptarts
-bool NoCredit::addPoptart(int number)
+template <class Base, class... Fillings>
+constexpr PresetRecipe Recipe<Base, Fillings...>::preset(const char* name)
 {
-	cout << "Error! Dispenser already contains poptarts!" << endl;
-	return false;
+	// the preset is priced from its slots at runtime, so summing the items here must agree with
+	// decoding its option code and pricing it from the catalogue table, as a decoded selection is
+	static_assert(cost() == PriceTable::catalogue().quote(optionCode()), "Recipe cost must match the catalogue price of its option code");
+	return PresetRecipe{ name, optionCode(), { optionSlot(Base::optionCode), optionSlot(Fillings::optionCode)... }, sizeof...(Fillings) + 1, description(), &make };
 }
 
-// Cannot dispense poptarts as user
-// has insufficient credit
-bool NoCredit::dispense(void)
+
+// an event reported by a dispenser to its listeners after one of its methods has been called
+struct DispenserRecord
 {
-	cout << "Error! Insufficient credit!" << endl;
+	uint32_t dispenserId;	// id of the dispenser the event happened on
+	int64_t timestamp;		// time of the event in microseconds since 1970
+	dispenserEvent type;	// method that was called e.g. Insert_Money
+	int argument;			// money inserted, option selected, poptarts added or cost of the poptart dispensed, otherwise 0
+	bool accepted;			// value returned by the method, for 'Dispense' whether a poptart was actually dispensed
+	int stateIndex;			// state the dispenser was left in
+};
+
+// interface for anything that wants to follow the events of a dispenser e.g. the 'TraceWriter'
+class DispenserListener
+{
+public:
+	virtual ~DispenserListener(void) {};
+	virtual void onEvent(const DispenserRecord& record) = 0;	// called after every event on a dispenser the listener was added to
+};
+
+// a period of time within a traced customer session
+struct TraceSpan
+{
+	uint64_t session;		// id of the session the span belongs to
+	uint32_t dispenserId;	// id of the dispenser the session happened on
+	sessionSpan kind;		// whether the span is a method call, time spent in a state or the whole session
+	int detail;				// the 'dispenserEvent' for a call or the 'state' for time spent in a state
+	int argument;			// argument passed to the method for a call, otherwise 0
+	int64_t start;			// start of the span in microseconds
+	int64_t end;			// end of the span in microseconds
+};
+
+// follows customer sessions through the dispensers it is given to, from the first 'insertMoney'
+// through each selection, state change and dispense to 'getProduct', and exports them
+// in the Chrome trace event format (chrome://tracing or Perfetto)
+// only 1 in every 'sampleEvery' sessions is traced, the rest cost a single check per call
+// each thread records into its own buffer with no locks, exporting can happen while threads record
+class SessionTracer
+{
+	// spans recorded by one thread, only that thread writes to it
+	struct TraceBuffer
+	{
+		static const int Capacity = 1 << 16;	// number of spans kept per thread, any more are dropped
+		TraceSpan spans[Capacity];
+		atomic<int> written;					// number of spans in 'spans' that are ready to be read
+		atomic<long long> dropped;				// number of spans dropped because the buffer was full
+		TraceBuffer(void) : written(0), dropped(0) {}
+	};
+
+	unsigned long long tracerId;			// unique id so a thread can tell which tracer its cached buffer belongs to
+	atomic<int> sampleEvery;				// traces 1 in every 'sampleEvery' sessions, 0 traces none
+	atomic<unsigned long long> sessionCount;	// number of sessions started
+	mutex buffersLock;						// only taken when a thread records for the first time or when exporting
+	vector<TraceBuffer*> buffers;			// buffer of every thread that has recorded a span
+
+	TraceBuffer* threadBuffer(void);		// returns the buffer of the calling thread
+
+public:
+	SessionTracer(int sampleRate);	// constructor which traces 1 in every 'sampleRate' sessions
+	~SessionTracer(void);			// deletes every thread's buffer
+	void setSampleRate(int sampleRate);		// traces 1 in every 'sampleRate' sessions from now on, 0 turns tracing off
+	uint64_t beginSession(void);			// returns the id of a new session, 0 if it isn't sampled
+	void record(const TraceSpan& span);		// adds 'span' to the calling thread's buffer
+	long long getDroppedCount(void);		// returns the number of spans dropped because a buffer was full
+	void exportJson(ostream& out);			// writes every span recorded so far as a Chrome trace
+	void clear(void);						// forgets every span, only safe while no thread is recording
+	static int64_t now(void);				// returns the current time in microseconds
+};
+
+SessionTracer::SessionTracer(int sampleRate) : sampleEvery(sampleRate > 0 ? sampleRate : 0), sessionCount(0)
+{
+	static atomic<unsigned long long> nextTracerId(1);
+	this->tracerId = nextTracerId.fetch_add(1);
+}
+
+SessionTracer::~SessionTracer(void)
+{
+	for (int i = 0; i < (int)this->buffers.size(); i++) delete this->buffers[i];
+	this->buffers.clear();
+}
+
+void SessionTracer::setSampleRate(int sampleRate)
+{
+	this->sampleEvery.store(sampleRate > 0 ? sampleRate : 0, memory_order_relaxed);
+}
+
+uint64_t SessionTracer::beginSession(void)
+{
+	int rate = this->sampleEvery.load(memory_order_relaxed);
+	if (rate == 0) return 0;	// if tracing is off no session is traced
+
+	unsigned long long count = this->sessionCount.fetch_add(1, memory_order_relaxed);
+	if (count % rate != 0) return 0;	// else only every 'rate'th session is traced
+	return count + 1;
+}
+
+SessionTracer::TraceBuffer* SessionTracer::threadBuffer(void)
+{
+	// each thread keeps its buffer for every tracer it has recorded for, so a thread driving
+	// dispensers with different tracers gets exactly one buffer per tracer and the lock is
+	// only taken the first time it records for each one
+	// tracer ids are never reused, so entries left by a deleted tracer are never looked up again
+	thread_local unsigned long long cachedTracer = 0;
+	thread_local TraceBuffer* cachedBuffer = nullptr;
+	thread_local map<unsigned long long, TraceBuffer*> threadBuffers;
+	if (cachedTracer == this->tracerId) return cachedBuffer;	// most calls come from the same tracer as the last one
+
+	TraceBuffer*& buffer = threadBuffers[this->tracerId];
+	if (buffer == nullptr)
+	{
+		buffer = new TraceBuffer();
+		lock_guard<mutex> lock(this->buffersLock);
+		this->buffers.push_back(buffer);
+	}
+	cachedTracer = this->tracerId;
+	cachedBuffer = buffer;
+	return buffer;
+}
+
+void SessionTracer::record(const TraceSpan& span)
+{
+	TraceBuffer* buffer = this->threadBuffer();
+	int position = buffer->written.load(memory_order_relaxed);
+	if (position >= TraceBuffer::Capacity)	// if the buffer is full the span is dropped rather than overwriting one being exported
+	{
+		buffer->dropped.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+	buffer->spans[position] = span;
+	buffer->written.store(position + 1, memory_order_release);	// the span is only visible to 'exportJson' once it is complete
+}
+
+long long SessionTracer::getDroppedCount(void)
+{
+	lock_guard<mutex> lock(this->buffersLock);
+	long long dropped = 0;
+	for (int i = 0; i < (int)this->buffers.size(); i++) dropped += this->buffers[i]->dropped.load(memory_order_relaxed);
+	return dropped;
+}
+
+void SessionTracer::exportJson(ostream& out)
+{
+	static const char* callNames[] = { "insertMoney", "makeSelection", "moneyRejected", "addPoptart", "dispense", "getProduct" };
+	static const char* stateNames[] = { "Out_Of_Poptart", "No_Credit", "Has_Credit", "Dispenses_Poptart" };
+
+	lock_guard<mutex> lock(this->buffersLock);
+	long long dropped = 0;
+	bool first = true;
+	out << "{\"traceEvents\":[";
+	for (int i = 0; i < (int)this->buffers.size(); i++)
+	{
+		int count = this->buffers[i]->written.load(memory_order_acquire);
+		dropped += this->buffers[i]->dropped.load(memory_order_relaxed);
+		for (int j = 0; j < count; j++)
+		{
+			const TraceSpan& span = this->buffers[i]->spans[j];
+			const char* name = "session";
+			const char* category = "session";
+			if (span.kind == Call_Span)
+			{
+				name = callNames[span.detail];
+				category = "call";
+			}
+			else if (span.kind == State_Span)
+			{
+				name = stateNames[span.detail];
+				category = "state";
+			}
+
+			// each dispenser is shown as a process and each session as a thread within it
+			out << (first ? "" : ",") << "\n{\"name\":\"" << name << "\",\"cat\":\"" << category << "\",\"ph\":\"X\""
+				<< ",\"ts\":" << span.start << ",\"dur\":" << span.end - span.start
+				<< ",\"pid\":" << span.dispenserId << ",\"tid\":" << span.session;
+			if (span.kind == Call_Span) out << ",\"args\":{\"argument\":" << span.argument << "}";
+			out << "}";
+			first = false;
+		}
+	}
+	out << "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedSpans\":" << dropped << "}}\n";
+}
+
+void SessionTracer::clear(void)
+{
+	lock_guard<mutex> lock(this->buffersLock);
+	for (int i = 0; i < (int)this->buffers.size(); i++)
+	{
+		this->buffers[i]->written.store(0, memory_order_relaxed);
+		this->buffers[i]->dropped.store(0, memory_order_relaxed);
+	}
+}
+
+int64_t SessionTracer::now(void)
+{
+	return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// interface for the hardware (motor, heater and chute) that physically dispenses a poptart
+// dispensing takes hundreds of milliseconds, so 'request' only starts it and returns straight away
+// the dispenser stays in 'Dispenses_Poptart' until 'completeDispense' is called on it, normally by the 'DispenseReactor'
+// an actuator deleted while dispensers still use it must call 'detachActuator' on each of them
+class Actuator
+{
+public:
+	virtual ~Actuator(void) {};
+	virtual void attach(Poptart_Dispenser* dispenser) = 0;	// 'dispenser' has started using the actuator
+	virtual void request(Poptart_Dispenser* dispenser) = 0;	// starts dispensing the selected poptart
+	virtual void cancel(Poptart_Dispenser* dispenser) = 0;	// 'dispenser' has stopped using the actuator e.g. it is deleted, no completion may be delivered to it afterwards
+};
+
+class Poptart_Dispenser : public StateContext, public Transition
+{
+	friend class DispensesPoptart;	// allows the DispensesPoptart class to access the private methods and variables of this class
+	friend class HasCredit;	// allows the HasCredit class to access the private methods and variables of this class
+	friend class StateExplorer;	// allows the StateExplorer class to load and read back each configuration it explores
+private:
+	PoptartState* PoptartCurrentState = nullptr;	// pointer to PoptartState class initialised to nullptr (default values)
+	bool itemDispensed = false;
+	//indicates whether a product is there to be retrieved
+	Product* DispensedItem = nullptr;
+	bool itemRetrieved = false; //indicates whether a product has been retrieved
+	vector<PresetRecipe> presets;	// preset recipes registered with the dispenser
+	int selectedPreset = -1;		// index of the selected preset in 'presets', -1 if the selection was decoded at runtime
+	int presetCost = 0;				// price the selected preset was quoted at
+	PriceBoard* Prices = &PriceBoard::fleet();	// pointer to the 'PriceBoard' prices are read from, the fleet board by default
+	PriceTable quotedPrices;		// copy of the prices read when the current selection was made
+	int findPreset(int option);		// returns the index of the preset registered with the 'option' code, -1 if there isn't one
+
+	// an order accepted from the next customer while the dispenser is still dispensing
+	struct PendingOrder
+	{
+		Product* item;	// poptart selected, costed at the prices quoted when the order was made
+		int credit;		// credit the customer inserted for this order
+		bool sessionOpen;		// true if the customer's session is being followed by the tracer
+		uint64_t session;		// id of the customer's traced session, 0 if it isn't sampled
+		int64_t sessionStarted;	// time the customer's traced session started
+	};
+	int pipelineDepth = 0;				// number of orders that can wait while dispensing, 0 serves one customer at a time
+	deque<PendingOrder> pendingOrders;	// orders waiting to be dispensed in the order they were made
+	int nextCredit = 0;					// credit inserted by the next customer that hasn't been used for an order yet
+	bool nextCustomerWaiting(void);		// returns true if an order or credit from the next customer is waiting
+	void serveNextCustomer(void);		// refunds the current customer's change and moves on to the next customer
+	void adoptSession(bool open, uint64_t session, int64_t started);	// makes a waiting customer's session the current one
+
+	uint32_t dispenserId = 0;					// id reported with every event e.g. the serial number of the dispenser
+	vector<DispenserListener*> listeners;		// listeners told about every event, none by default
+	void notify(dispenserEvent type, int argument, bool accepted);	// tells every listener about the event
+
+	SessionTracer* Tracer = nullptr;	// pointer to the 'SessionTracer' following customer sessions initialised to nullptr (tracing off)
+	bool sessionOpen = false;			// true from a customer's first 'insertMoney' until their session finishes
+	uint64_t traceSession = 0;			// id of the session being traced, 0 if the current session isn't sampled
+	int64_t sessionStarted = 0;			// time the traced session started
+	int64_t stateEntered = 0;			// time the traced session entered the current state
+	bool nextSessionOpen = false;		// true from the next customer's first 'insertMoney' while pipelining until their order is queued
+	uint64_t nextSession = 0;			// id of the next customer's traced session, 0 if it isn't sampled
+	int64_t nextSessionStarted = 0;		// time the next customer's traced session started
+	void beginSession(void);			// starts a new customer session, traced if the tracer samples it
+	void endSession(void);				// finishes the current customer session
+	void beginNextSession(void);		// starts a session for the next customer while the current one is being served
+	void endWaitingSession(uint64_t session, int64_t started);	// finishes the session of a customer who left before being served
+	void traceCall(uint64_t session, dispenserEvent type, int argument, int64_t started);	// records a method call in the traced 'session'
+
+	Actuator* Hardware = nullptr;	// pointer to the 'Actuator' that dispenses poptarts initialised to nullptr (dispenses instantly)
+	bool actuating = false;			// true while the actuator is dispensing
+	int64_t dispenseStarted = 0;	// time the traced session asked the actuator to dispense
+public:
+	Poptart_Dispenser(int inventory_count);
+	~Poptart_Dispenser(void);
+	bool insertMoney(int money);
+	bool makeSelection(int option);
+	bool moneyRejected(void);
+	bool addPoptart(int number);
+	bool dispense(void);
+	Product* getProduct(void);
+	bool registerPreset(const PresetRecipe& preset);	// registers a preset so 'makeSelection' can sell it without decoding the option code
+	void setPriceBoard(PriceBoard* board);	// reads prices from 'board' instead of the fleet board
+	void setPipelineDepth(int depth);		// lets up to 'depth' orders from the next customers wait while dispensing
+	void setDispenserId(uint32_t id);		// sets the id reported with every event
+	uint32_t getDispenserId(void);			// returns the id reported with every event
+	void addListener(DispenserListener* listener);		// tells 'listener' about every event from now on
+	void removeListener(DispenserListener* listener);	// stops telling 'listener' about events
+	void setSessionTracer(SessionTracer* tracer);		// follows customer sessions using 'tracer', nullptr turns tracing off
+	void setActuator(Actuator* actuator);				// dispenses using 'actuator', nullptr dispenses instantly
+	void completeDispense(bool success);				// called when the actuator has finished, 'success' is false if it failed
+	void detachActuator(void);							// called by an actuator being deleted, fails any dispense in progress and dispenses instantly from then on
+	virtual void setState(state newState);
+	virtual void setStateParam(stateParameter SP, int value);
+	virtual int getStateParam(stateParameter SP);
+};
+
+// constructor that is used when the object is initialised using a starting amount of poptarts available for its argument
+Poptart_Dispenser::Poptart_Dispenser(int inventory_count)
+{
+	// poptart should start with an inventory count of 0
+	// meaning it starts in the Out_Of_Poptart state
+	// it should then add a poptart which should change the state
+	// based on the current state it is in
+
+	// add all available states to the 'availableStates' vector
+	this->availableStates.push_back(new OutOfPoptart(this));
+	this->availableStates.push_back(new NoCredit(this));
+	this->availableStates.push_back(new HasCredit(this));
+	this->availableStates.push_back(new DispensesPoptart(this));
+
+	this->stateParameters.push_back(0);	// No of Poptarts
+	this->stateParameters.push_back(0); // Credit
+
+	this->setState(Out_Of_Poptart);	// setting starting state to 'Out_Of_Poptart'
+
+	// if 'inventory_count' (poptarts) are greater than 0 when first initialising
+	// add the poptarts using the 'addPoptart' method which also sets the
+	// state to 'No_Credit'
+	if (inventory_count > 0)
+	{
+		this->addPoptart(inventory_count);
+	}
+}
+
+// deletes product poptart at end of execution
+Poptart_Dispenser::~Poptart_Dispenser(void)
+{
+	if (this->Hardware != nullptr) this->Hardware->cancel(this);	// the actuator mustn't complete a dispense for (or keep a pointer to) a deleted dispenser
+
+	if (!this->itemRetrieved)
+	{
+		delete this->DispensedItem;
+	}
+
+	// deletes any orders that were never dispensed
+	for (int i = 0; i < (int)this->pendingOrders.size(); i++) delete this->pendingOrders[i].item;
+	this->pendingOrders.clear();
+}
+
+// sets the current state to the specified state
+// then calls the insertMoney method which has a different function
+// depending on the current state
+bool Poptart_Dispenser::insertMoney(int money)
+{
+	// while pipelining, money inserted during a dispense belongs to the next customer
+	// who is followed in a session of their own until they are served
+	bool forNext = this->pipelineDepth > 0 && this->getStateIndex() == Dispenses_Poptart;
+
+	// the first money inserted starts a customer session,
+	// money inserted with no credit left means the last customer walked away
+	if (this->Tracer != nullptr && forNext && !this->nextSessionOpen)
+	{
+		this->beginNextSession();
+	}
+	else if (this->Tracer != nullptr && !forNext && (!this->sessionOpen || this->getStateIndex() == No_Credit))
+	{
+		if (this->sessionOpen) this->endSession();
+		this->beginSession();
+	}
+	uint64_t session = forNext ? this->nextSession : this->traceSession;
+	int64_t started = session != 0 ? SessionTracer::now() : 0;
+
+	PoptartCurrentState = (PoptartState*) this->CurrentState;
+	bool accepted = this->PoptartCurrentState->insertMoney(money);
+	this->notify(Insert_Money, money, accepted);
+
+	if (session != 0) this->traceCall(session, Insert_Money, money, started);
+	if (forNext)
+	{
+		if (this->nextSessionOpen && !accepted && this->nextCredit == 0)	// the next customer couldn't pay so their session is over
+		{
+			this->endWaitingSession(this->nextSession, this->nextSessionStarted);
+			this->nextSessionOpen = false;
+		}
+	}
+	else if (this->sessionOpen && !accepted && this->getStateParam(Credit) == 0)	// the money was refunded so the session is over
+	{
+		this->endSession();
+	}
+	return accepted;
+}
+
+// sets the current state to the specified state
+// then calls the makeSelection method which has a different function
+// depending on the current state
+bool Poptart_Dispenser::makeSelection(int option)
+{
+	bool forNext = this->pipelineDepth > 0 && this->getStateIndex() == Dispenses_Poptart;
+	uint64_t session = forNext ? this->nextSession : this->traceSession;	// taken first as a queued order takes the session with it
+	int64_t started = session != 0 ? SessionTracer::now() : 0;
+	PoptartCurrentState = (PoptartState*) this->CurrentState;
+	bool accepted = this->PoptartCurrentState->makeSelection(option);
+	this->notify(Make_Selection, option, accepted);
+	if (session != 0) this->traceCall(session, Make_Selection, option, started);
+	return accepted;
+}
+
+// sets the current state to the specified state
+// then calls the moneyRejected method which has a different function
+// depending on the current state
+bool Poptart_Dispenser::moneyRejected(void)
+{
+	bool forNext = this->pipelineDepth > 0 && this->getStateIndex() == Dispenses_Poptart;
+	uint64_t session = forNext ? this->nextSession : this->traceSession;
+	int64_t started = session != 0 ? SessionTracer::now() : 0;
+	PoptartCurrentState = (PoptartState*) this->CurrentState;
+	bool accepted = this->PoptartCurrentState->moneyRejected();
+	this->notify(Money_Rejected, 0, accepted);
+	if (session != 0) this->traceCall(session, Money_Rejected, 0, started);
+	if (forNext)
+	{
+		if (this->nextSessionOpen && accepted)	// the next customer took their money back before ordering
+		{
+			this->endWaitingSession(this->nextSession, this->nextSessionStarted);
+			this->nextSessionOpen = false;
+		}
+	}
+	else if (this->sessionOpen && accepted && this->getStateIndex() == No_Credit)	// the customer took their money back
+	{
+		this->endSession();
+	}
+	return accepted;
+}
+
+// sets the current state to the specified state
+// then calls the addPoptart method which has a different function
+// depending on the current state
+bool Poptart_Dispenser::addPoptart(int number)
+{
+	PoptartCurrentState = (PoptartState*) this->CurrentState;
+	bool accepted = this->PoptartCurrentState->addPoptart(number);
+	this->notify(Add_Poptart, number, accepted);
+	return accepted;
+}
+
+// sets the current state to the specified state
+// then calls the dispense method which has a different function
+// depending on the current state
+bool Poptart_Dispenser::dispense(void)
+{
+	PoptartCurrentState = (PoptartState*) this->CurrentState;
+	if (this->listeners.empty() && this->traceSession == 0) return this->PoptartCurrentState->dispense();	// no need to work out what was dispensed
+
+	// 'dispense' returns true even when there isn't enough credit,
+	// so listeners are told whether the stock actually went down
+	uint64_t session = this->traceSession;	// taken first as the next customer may be served if nothing is dispensed
+	int64_t started = session != 0 ? SessionTracer::now() : 0;
+	int cost = this->getStateParam(Cost_Of_Poptart);
+	int poptarts = this->getStateParam(No_Of_Poptarts);
+	bool wasActuating = this->actuating;	// a dispense asked for while the actuator is busy is rejected and reported now
+	bool result = this->PoptartCurrentState->dispense();
+	if (this->actuating && !wasActuating)	// if this call started the actuator, 'completeDispense' tells the listeners once it finishes
+	{
+		this->dispenseStarted = started;
+		return result;
+	}
+	this->notify(Dispense, cost, this->getStateParam(No_Of_Poptarts) < poptarts);
+	if (session != 0) this->traceCall(session, Dispense, cost, started);
+	return result;
+}
+
+Product* Poptart_Dispenser::getProduct(void)
+{
+	int64_t started = this->traceSession != 0 ? SessionTracer::now() : 0;
+	if (this->itemDispensed)	// if item has been dispensed
+	{
+		if (this->selectedPreset >= 0)	// if a preset was dispensed the poptart is built now it is being collected (this allocates the decorator chain)
+		{
+			this->DispensedItem = this->presets[this->selectedPreset].make(this->quotedPrices);
+			this->selectedPreset = -1;
+		}
+		this->itemDispensed = false;	// then set itemDispensed back to false
+		this->itemRetrieved = true;		// and item retrieved to true as it has been dispensed
+
+		// collecting the poptart finishes the session, then if the next customer
+		// was waiting for this poptart to be collected they can now be served
+		Product* collected = this->DispensedItem;
+		bool serveNext = this->getStateIndex() == Dispenses_Poptart && this->nextCustomerWaiting();
+		if (this->traceSession != 0) this->traceCall(this->traceSession, Get_Product, 0, started);
+		if (this->sessionOpen) this->endSession();
+		if (serveNext) this->serveNextCustomer();
+		this->notify(Get_Product, 0, true);
+		return collected;				// return the DispensedItem (Poptart) object
+	}
+
+	this->notify(Get_Product, 0, false);
+	if (this->traceSession != 0) this->traceCall(this->traceSession, Get_Product, 0, started);
+	return nullptr;	// else return nullptr
+}
+
+// adds 'preset' to the presets that 'makeSelection' can sell directly
+// returns false if another preset already uses the same option code
+bool Poptart_Dispenser::registerPreset(const PresetRecipe& preset)
+{
+	if (this->findPreset(preset.option) >= 0)
+	{
+		this->output() << "Error! Option " << preset.option << " is already registered!" << endl;
+		return false;
+	}
+	this->presets.push_back(preset);
+	return true;
+}
+
+void Poptart_Dispenser::setPriceBoard(PriceBoard* board)
+{
+	this->Prices = board;
+}
+
+// pipelining lets the next customers insert money and make a selection
+// while the current poptart is still being dispensed and collected
+// their orders are checked straight away and dispensed in the order they were made
+void Poptart_Dispenser::setPipelineDepth(int depth)
+{
+	this->pipelineDepth = depth > 0 ? depth : 0;
+}
+
+void Poptart_Dispenser::setDispenserId(uint32_t id)
+{
+	this->dispenserId = id;
+}
+
+uint32_t Poptart_Dispenser::getDispenserId(void)
+{
+	return this->dispenserId;
+}
+
+void Poptart_Dispenser::addListener(DispenserListener* listener)
+{
+	this->listeners.push_back(listener);
+}
+
+void Poptart_Dispenser::removeListener(DispenserListener* listener)
+{
+	for (int i = 0; i < (int)this->listeners.size(); i++)
+	{
+		if (this->listeners[i] == listener)
+		{
+			this->listeners.erase(this->listeners.begin() + i);
+			return;
+		}
+	}
+}
+
+void Poptart_Dispenser::notify(dispenserEvent type, int argument, bool accepted)
+{
+	if (this->listeners.empty()) return;	// if nobody is listening there's nothing to record
+
+	DispenserRecord record;
+	record.dispenserId = this->dispenserId;
+	record.timestamp = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	record.type = type;
+	record.argument = argument;
+	record.accepted = accepted;
+	record.stateIndex = this->getStateIndex();
+	for (int i = 0; i < (int)this->listeners.size(); i++) this->listeners[i]->onEvent(record);
+}
+
+void Poptart_Dispenser::setActuator(Actuator* actuator)
+{
+	if (this->Hardware != nullptr) this->Hardware->cancel(this);
+	this->actuating = false;
+	this->Hardware = actuator;
+	if (this->Hardware != nullptr) this->Hardware->attach(this);
+}
+
+// the actuator is going away, so a dispense it started can never complete
+// the customer isn't charged and keeps their credit, as when the hardware fails
+void Poptart_Dispenser::detachActuator(void)
+{
+	this->completeDispense(false);
+	this->Hardware = nullptr;
+}
+
+// finishes the dispense the actuator was asked for
+// then changes state as 'dispense' does when there's no actuator
+void Poptart_Dispenser::completeDispense(bool success)
+{
+	if (!this->actuating) return;	// if nothing is being dispensed the completion is out of date
+
+	int cost = this->getStateParam(Cost_Of_Poptart);
+	uint64_t session = this->traceSession;
+	((DispensesPoptart*)this->availableStates[Dispenses_Poptart])->complete(success);
+	this->notify(Dispense, cost, success);
+	if (session != 0) this->traceCall(session, Dispense, cost, this->dispenseStarted);	// the span covers the time the hardware took
+}
+
+void Poptart_Dispenser::setSessionTracer(SessionTracer* tracer)
+{
+	if (this->sessionOpen) this->endSession();
+
+	// sessions of customers still waiting belong to the old tracer, so they aren't followed any further
+	this->nextSessionOpen = false;
+	this->nextSession = 0;
+	for (int i = 0; i < (int)this->pendingOrders.size(); i++)
+	{
+		this->pendingOrders[i].sessionOpen = false;
+		this->pendingOrders[i].session = 0;
+	}
+	this->Tracer = tracer;
+}
+
+// records the time spent in the state being left before changing state
+void Poptart_Dispenser::setState(state newState)
+{
+	if (this->traceSession != 0)
+	{
+		int64_t now = SessionTracer::now();
+		TraceSpan span = { this->traceSession, this->dispenserId, State_Span, this->getStateIndex(), 0, this->stateEntered, now };
+		this->Tracer->record(span);
+		this->stateEntered = now;
+	}
+	StateContext::setState(newState);
+}
+
+void Poptart_Dispenser::beginSession(void)
+{
+	this->sessionOpen = true;
+	this->traceSession = this->Tracer->beginSession();
+	if (this->traceSession != 0) this->sessionStarted = this->stateEntered = SessionTracer::now();
+}
+
+void Poptart_Dispenser::endSession(void)
+{
+	if (this->traceSession != 0)	// closes the span for the final state and the span for the whole session
+	{
+		int64_t now = SessionTracer::now();
+		TraceSpan stateSpan = { this->traceSession, this->dispenserId, State_Span, this->getStateIndex(), 0, this->stateEntered, now };
+		TraceSpan sessionSpan = { this->traceSession, this->dispenserId, Session_Span, 0, 0, this->sessionStarted, now };
+		this->Tracer->record(stateSpan);
+		this->Tracer->record(sessionSpan);
+	}
+	this->sessionOpen = false;
+	this->traceSession = 0;
+}
+
+void Poptart_Dispenser::beginNextSession(void)
+{
+	this->nextSessionOpen = true;
+	this->nextSession = this->Tracer->beginSession();
+	this->nextSessionStarted = this->nextSession != 0 ? SessionTracer::now() : 0;
+}
+
+void Poptart_Dispenser::endWaitingSession(uint64_t session, int64_t started)
+{
+	if (session == 0) return;
+	TraceSpan span = { session, this->dispenserId, Session_Span, 0, 0, started, SessionTracer::now() };
+	this->Tracer->record(span);
+}
+
+void Poptart_Dispenser::traceCall(uint64_t session, dispenserEvent type, int argument, int64_t started)
+{
+	TraceSpan span = { session, this->dispenserId, Call_Span, type, argument, started, SessionTracer::now() };
+	this->Tracer->record(span);
+}
+
+bool Poptart_Dispenser::nextCustomerWaiting(void)
+{
+	return !this->pendingOrders.empty() || this->nextCredit > 0;
+}
+
+void Poptart_Dispenser::serveNextCustomer(void)
+{
+	if (this->sessionOpen) this->endSession();	// the current customer has finished, e.g. they couldn't afford their poptart
+
+	// the current customer has finished so any credit they have left is given back as change
+	if (this->getStateParam(Credit) > 0)
+	{
+		this->output() << "Refunding change: " << this->getStateParam(Credit) << endl;
+		this->setStateParam(Credit, 0);
+	}
+
+	// if an order is waiting it becomes the current selection ready for dispensing
+	if (!this->pendingOrders.empty())
+	{
+		PendingOrder order = this->pendingOrders.front();
+		this->pendingOrders.pop_front();
+
+		if (!this->itemRetrieved) delete this->DispensedItem;	// deletes a poptart that couldn't be dispensed
+		this->DispensedItem = order.item;
+		this->selectedPreset = -1;
+		this->itemDispensed = false;
+		this->itemRetrieved = false;
+		this->setStateParam(Credit, order.credit);
+		this->output() << "Next order: " << order.item->description() << " Poptart." << endl;
+		this->setState(Dispenses_Poptart);
+		this->adoptSession(order.sessionOpen, order.session, order.sessionStarted);	// the customer's session carries on as the current one
+		return;
+	}
+
+	// else the next customer has inserted credit but not chosen yet
+	this->setStateParam(Credit, this->nextCredit);
+	this->nextCredit = 0;
+	this->setState(Has_Credit);
+	this->adoptSession(this->nextSessionOpen, this->nextSession, this->nextSessionStarted);
+	this->nextSessionOpen = false;
+	this->nextSession = 0;
+	if (this->getStateParam(No_Of_Poptarts) == 0)	// if the last poptart has gone their credit is refunded
+	{
+		this->setState(Out_Of_Poptart);
+		this->output() << "Refunding credit: " << this->getStateParam(Credit) << endl;
+		this->setStateParam(Credit, 0);
+		if (this->sessionOpen) this->endSession();
+	}
+}
+
+void Poptart_Dispenser::adoptSession(bool open, uint64_t session, int64_t started)
+{
+	this->sessionOpen = open;
+	this->traceSession = session;
+	this->sessionStarted = started;
+	if (session != 0) this->stateEntered = SessionTracer::now();
+}
+
+int Poptart_Dispenser::findPreset(int option)
+{
+	for (int i = 0; i < (int)this->presets.size(); i++)
+	{
+		if (this->presets[i].option == option) return i;
+	}
+	return -1;
+}
+
+
+void Poptart_Dispenser::setStateParam(stateParameter SP, int value)
+{
+	if (SP == Cost_Of_Poptart) return;	// if StateParameter 'SP' is equal to the StateParameter 'Cost_Of_Poptart' exit method
+	StateContext::setStateParam(SP, value);	// else stores it like any context, which also keeps the fleet index up to date
+}
+
+int Poptart_Dispenser::getStateParam(stateParameter SP)
+{
+	if (SP == Cost_Of_Poptart)	// if StateParameter 'SP' is equal to the StateParameter 'Cost_Of_Poptart'
+	{
+		if (selectedPreset >= 0) return presetCost;	// if a preset is selected, return the price it was quoted at
+		if (DispensedItem == nullptr) return 0;	// if 'DispensedItem' is nullptr, return 0
+		return DispensedItem->cost();			// else return the current cost of the 'DispensedItem' poptart
+	}
+	return this->stateParameters[SP];	// else return current 'SP' index
+}
+
+// OutOfPoptart State
+// Cannot insert money when the current state of 'OutOfPoptarts'
+// insertMoney calls 'moneyRejected' in order to refund credit
+bool OutOfPoptart::insertMoney(int money)
+{
+	this->CurrentContext->output() << "Error! No poptarts left." << endl;
+	this->moneyRejected();
+	return false;
+}
+
+// Cannot select a poptart as there are no poptarts in the dispenser
+bool OutOfPoptart::makeSelection(int option)
+{
+	this->CurrentContext->output() << "Error! No poptarts to select from!" << endl;
+	return false;
+}
+
+// No poptarts available therefore credit is rejected when entered
+bool OutOfPoptart::moneyRejected(void)
+{
+	this->CurrentContext->output() << "Refunding credit!" << endl;
+	return true;
+}
+
+// Adds poptarts to the dispenser
+// then changes state to 'No Credit'
+bool OutOfPoptart::addPoptart(int number)
+{
+	this->CurrentContext->setStateParam(No_Of_Poptarts, number);	// inserts poptarts into the vector 'stateParam' using index 'No_Of_Poptarts'
+	this->CurrentContext->setState(No_Credit);	// changes state to 'No_Credit'
+	return true;
+}
+
+// Cannot dispense as there are no poptarts within the dispenser
+bool OutOfPoptart::dispense(void)
+{
+	this->CurrentContext->output() << "Error! No poptarts available to dispense." << endl;
+	return false;
+
+}
+
+// NoCredit State
+// Inserts credit to the dispenser
+// then changes state to 'Has Credit'
+bool NoCredit::insertMoney(int money)
+{
+	this->CurrentContext->output() << "Inserting: " << money;
+	this->CurrentContext->setStateParam(Credit, money);	// inserts credit into the vector 'stateParam' using index 'Credit'
+	this->CurrentContext->output() << "\nNew Total: " << money << endl;
+	this->CurrentContext->setState(Has_Credit);	// changes state to 'Has_Credit'
+	return true;
+}
+
+
+// Cannot make a selection as user
+// has insufficient credit
+bool NoCredit::makeSelection(int option)
+{
+	this->CurrentContext->output() << "Error! Insufficient credit!" << endl;
+	return false;
+}
+
+
+// NOT SURE ON COMMON SENSE
+bool NoCredit::moneyRejected(void)
+{
+	this->CurrentContext->output() << "Error! Cannot reject credit in this state!" << endl;
+	return false;
+}
+
+// Cannot add poptarts from this state
+// as dispenser already contains poptarts
+bool NoCredit::addPoptart(int number)
+{
+	this->CurrentContext->output() << "Error! Dispenser already contains poptarts!" << endl;
+	return false;
+}
+
+// Cannot dispense poptarts as user
+// has insufficient credit
+bool NoCredit::dispense(void)
+{
+	this->CurrentContext->output() << "Error! Insufficient credit!" << endl;
+	return false;
+}
+
+// HasCredit State
+// Inserts credit to the dispenser from the 'HasCredit' state
+// which also adds to the current total amount
+bool HasCredit::insertMoney(int money)
+{
+	this->CurrentContext->output() << "Inserting: " << money;
+	money = money + this->CurrentContext->getStateParam(Credit);	// 'money' is equal to 'money' + the current credit stored in the 'stateParam' vector using the index 'Credit'  
+	this->CurrentContext->setStateParam(Credit, money);	// inserts the 'money' into the 'setStateParam' vector using index 'Credit'
+	this->CurrentContext->output() << "\n New Total: " << money << endl;
+	this->CurrentContext->setState(Has_Credit);	// changes state to 'Has_Credit' as user now has sufficient credit
+	return true;
+}
+
+// Allows the user to select their poptart base and filling
+// using the 'option' argument ready for dispensing
+// uses bitmasking in order to allow the user to select a base
+// and multiple fillings using 1 option code argument
+bool HasCredit::makeSelection(int option)
+{
+	if (!selectsBase(option))	// if no base is selected there's nothing to add the fillings to
+	{
+		this->CurrentContext->output() << "Error! Please select a base!" << endl;
+		return false;
+	}
+
+	this->CurrentContext->output() << "Selection made!" << endl;
+	if (!((Poptart_Dispenser*)this->CurrentContext)->itemRetrieved)	// if no poptart has been retrieved
+	{
+		delete ((Poptart_Dispenser*)this->CurrentContext)->DispensedItem;	// deletes the previous dispensed poptart
+	}
+	((Poptart_Dispenser*)this->CurrentContext)->itemDispensed = false;	// the previous poptart has either been collected or deleted so there's nothing to collect
+
+	// PRICES
+	// the current prices are copied without taking a lock, the selection keeps this copy
+	// so prices published after this point don't change what the customer is charged
+	((Poptart_Dispenser*)this->CurrentContext)->quotedPrices = ((Poptart_Dispenser*)this->CurrentContext)->Prices->read();
+
+	// PRESETS
+	// a registered preset already knows its description and which items it is made of
+	// so the option code doesn't need decoding, only its items are priced from the quoted table
+	// and the poptart is only built when collected
+	((Poptart_Dispenser*)this->CurrentContext)->selectedPreset = ((Poptart_Dispenser*)this->CurrentContext)->findPreset(option);
+	if (((Poptart_Dispenser*)this->CurrentContext)->selectedPreset >= 0)
+	{
+		((Poptart_Dispenser*)this->CurrentContext)->presetCost = ((Poptart_Dispenser*)this->CurrentContext)->quotedPrices.total(
+			((Poptart_Dispenser*)this->CurrentContext)->presets[((Poptart_Dispenser*)this->CurrentContext)->selectedPreset].slots,
+			((Poptart_Dispenser*)this->CurrentContext)->presets[((Poptart_Dispenser*)this->CurrentContext)->selectedPreset].slotCount);
+		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = nullptr;
+		((Poptart_Dispenser*)this->CurrentContext)->itemRetrieved = false;
+		this->CurrentContext->setState(Dispenses_Poptart);	// changes state to 'Dispenses_Poptart'
+		return true;
+	}
+	
+	// selecting a base with multiple different fillings can be done via the use of bitmasking
+	// e.g. if I wanted a poptart with the base plain (1) and the fillings blackberry (1024) and banana (64)
+	// you pass '1089' to the option code allowing the selection of the base and multiple fillings specified
+	((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = decodeSelection(option, ((Poptart_Dispenser*)this->CurrentContext)->quotedPrices);	// builds the poptart from the base and fillings selected
+	
+	((Poptart_Dispenser*)this->CurrentContext)->itemRetrieved = false;	// sets 'itemRetrieved' to false meaning that the poptart is ready to be retrieved from the dispenser
+	this->CurrentContext->setState(Dispenses_Poptart);	// changes state to 'Dispenses_Poptart'
+	return true;	// returns true meaning no errors
+}
+
+// if moneyRejected is called in the 'HasCredit' state
+// then 
+bool HasCredit::moneyRejected(void)
+{
+	this->CurrentContext->output() << "Credit rejected!" << endl;
+	this->CurrentContext->setStateParam(Credit, 0);	// sets the 'money' into the 'setStateParam' vector to 0 using index 'Credit'
+	this->CurrentContext->setState(No_Credit);	// changes state to 'No_Credit'
+	return true;	// returns true meaning no errors
+}
+
+// Cannot add poptarts as dispenser already contains poptarts
+bool HasCredit::addPoptart(int number)
+{
+	this->CurrentContext->output() << "Error! Dispenser already contains poptarts!" << endl;
+	return false;	// returns false meaning an unexpected error has occurred
+}
+
+
+// Cannot dispense as user hasn't selected a poptart to be dispensed
+bool HasCredit::dispense(void)
+{
+	this->CurrentContext->output() << "Error! Please select poptart!" << endl;
+	return false;	// returns false meaning an unexpected error has occurred
+}
+
+// DispensesPoptart State
+// Cannot insertMoney as dispenser is preparing
+// to dispense poptart
+// unless pipelining is on, then the money is held for the next customer's order
+bool DispensesPoptart::insertMoney(int money)
+{
+	Poptart_Dispenser* dispenser = (Poptart_Dispenser*)this->CurrentContext;
+	if (dispenser->pipelineDepth == 0)
+	{
+		this->CurrentContext->output() << "Error! Already dispensing poptart!" << endl;
+		return false;	// returns false meaning an unexpected error has occurred
+	}
+	if ((int)dispenser->pendingOrders.size() >= dispenser->pipelineDepth)	// if the queue is full the next customer has to wait
+	{
+		this->CurrentContext->output() << "Error! Order queue is full!" << endl;
+		return false;
+	}
+
+	this->CurrentContext->output() << "Inserting: " << money;
+	dispenser->nextCredit = dispenser->nextCredit + money;
+	this->CurrentContext->output() << "\nNext customer total: " << dispenser->nextCredit << endl;
+	return true;
+}
+
+
+// Cannot makeSelection as user has already selected a poptart
+// to be dispensed
+// unless pipelining is on, then the next customer's selection is checked and queued
+bool DispensesPoptart::makeSelection(int option)
+{
+	Poptart_Dispenser* dispenser = (Poptart_Dispenser*)this->CurrentContext;
+	if (dispenser->pipelineDepth == 0)
+	{
+		this->CurrentContext->output() << "Error! Already dispensing poptart!" << endl;
+		return false;	// returns false meaning an unexpected error has occurred
+	}
+	if ((int)dispenser->pendingOrders.size() >= dispenser->pipelineDepth)
+	{
+		this->CurrentContext->output() << "Error! Order queue is full!" << endl;
+		return false;
+	}
+	if (dispenser->nextCredit == 0)
+	{
+		this->CurrentContext->output() << "Error! Insufficient credit!" << endl;
+		return false;
+	}
+	if (!selectsBase(option))
+	{
+		this->CurrentContext->output() << "Error! Please select a base!" << endl;
+		return false;
+	}
+
+	// every queued order and the current one (if not dispensed yet) already has a poptart set aside
+	int reserved = (int)dispenser->pendingOrders.size() + (dispenser->itemDispensed ? 0 : 1);
+	if (dispenser->getStateParam(No_Of_Poptarts) - reserved <= 0)
+	{
+		this->CurrentContext->output() << "Error! No poptarts left for this order!" << endl;
+		return false;
+	}
+
+	// the order is priced now and keeps that price until it is dispensed
+	PriceTable prices = dispenser->Prices->read();
+	int preset = dispenser->findPreset(option);
+	Product* item = preset >= 0 ? dispenser->presets[preset].make(prices) : decodeSelection(option, prices);
+	if (item->cost() > dispenser->nextCredit)	// the credit stays held so the customer can add more or choose again
+	{
+		this->CurrentContext->output() << "Error! Not enough money" << endl;
+		delete item;
+		return false;
+	}
+
+	Poptart_Dispenser::PendingOrder order;
+	order.item = item;
+	order.credit = dispenser->nextCredit;
+	order.sessionOpen = dispenser->nextSessionOpen;	// the customer's session waits with their order
+	order.session = dispenser->nextSession;
+	order.sessionStarted = dispenser->nextSessionStarted;
+	dispenser->pendingOrders.push_back(order);
+	dispenser->nextCredit = 0;
+	dispenser->nextSessionOpen = false;
+	dispenser->nextSession = 0;
+	this->CurrentContext->output() << "Order queued! Position: " << dispenser->pendingOrders.size() << endl;
+	return true;
+}
+
+
+// Cannot reject credit as dispenser is preparing
+// to dispense poptart
+// unless pipelining is on, then the credit held for the next customer is refunded
+bool DispensesPoptart::moneyRejected(void)
+{
+	Poptart_Dispenser* dispenser = (Poptart_Dispenser*)this->CurrentContext;
+	if (dispenser->pipelineDepth == 0 || dispenser->nextCredit == 0)
+	{
+		this->CurrentContext->output() << "Error! Already dispensing poptart!" << endl;
+		return false;	// returns false meaning an unexpected error has occurred
+	}
+
+	this->CurrentContext->output() << "Refunding credit: " << dispenser->nextCredit << endl;
+	dispenser->nextCredit = 0;
+	return true;
+}
+
+
+// Cannot addPoptart as dispenser is already
+// dispensing poptart
+bool DispensesPoptart::addPoptart(int number)
+{
+	this->CurrentContext->output() << "Error! Already dispensing poptart!" << endl;
+	return false;	// returns false meaning an unexpected error has occurred
+}
+
+// 'Dispenses' poptart from the Poptart_Dispenser
+// takes away the cost of the poptart from the users
+// existing credit
+bool DispensesPoptart::dispense(void)
+{
+	// when pipelining the dispenser waits here for the last poptart to be collected
+	// before the next order can be dispensed
+	if (((Poptart_Dispenser*)this->CurrentContext)->itemDispensed)
+	{
+		this->CurrentContext->output() << "Error! Please collect poptart!" << endl;
+		return false;
+	}
+
+	// only one dispense can be in progress at a time
+	if (((Poptart_Dispenser*)this->CurrentContext)->actuating)
+	{
+		this->CurrentContext->output() << "Error! Already dispensing poptart!" << endl;
+		return false;
+	}
+
+	// checks to see if the user has enough credit to dispense the selected poptart
+	if (this->CurrentContext->getStateParam(Credit) >= this->CurrentContext->getStateParam(Cost_Of_Poptart))
+	{
+		// if the dispenser has an actuator it is asked to dispense and the dispenser stays in this state
+		// until the actuator calls 'completeDispense', so the controller never waits for the hardware
+		if (((Poptart_Dispenser*)this->CurrentContext)->Hardware != nullptr)
+		{
+			((Poptart_Dispenser*)this->CurrentContext)->actuating = true;
+			((Poptart_Dispenser*)this->CurrentContext)->Hardware->request((Poptart_Dispenser*)this->CurrentContext);
+			return true;
+		}
+		this->release();
+	}
+	else // else if there's not enough credit to dispense poptart
+	{
+		this->CurrentContext->output() << "Error! Not enough money" << endl;
+	}
+
+	this->leave();
+	return true;
+}
+
+// finishes dispensing once the actuator has completed
+// if the hardware failed the customer isn't charged and keeps their credit to try again
+void DispensesPoptart::complete(bool success)
+{
+	((Poptart_Dispenser*)this->CurrentContext)->actuating = false;
+	if (success)
+	{
+		this->release();
+	}
+	else
+	{
+		this->CurrentContext->output() << "Error! Poptart could not be dispensed!" << endl;
+	}
+	this->leave();
+}
+
+// 'Releases' the poptart to the customer
+// takes away the cost of the poptart from the users existing credit
+void DispensesPoptart::release(void)
+{
+	// outputs the description of the currently dispensed poptart
+	if (((Poptart_Dispenser*)this->CurrentContext)->selectedPreset >= 0)	// presets use the description made at compile time
+	{
+		this->CurrentContext->output() << "Dispensing " << ((Poptart_Dispenser*)this->CurrentContext)->presets[((Poptart_Dispenser*)this->CurrentContext)->selectedPreset].description << " Poptart.\n";
+	}
+	else if (this->CurrentContext->output())	// the description is only built if the output isn't discarded
+	{
+		this->CurrentContext->output() << "Dispensing " << ((Poptart_Dispenser*)this->CurrentContext)->DispensedItem->description() << " Poptart.\n";
+	}
+
+	// subtracts the cost of the poptart from the amount of credits available in the dispenser
+	this->CurrentContext->setStateParam(Credit, this->CurrentContext->getStateParam(Credit)
+		- this->CurrentContext->getStateParam(Cost_Of_Poptart));
+
+	// removes the dispensed poptart from the dispenser by subtracting 1 from the available amount stored
+	// in the 'stateParam' vector using index 'No_Of_Poptarts'
+	this->CurrentContext->setStateParam(No_Of_Poptarts, this->CurrentContext->getStateParam(No_Of_Poptarts) - 1);
+
+	// sets the bool value of itemDispensed to true indicating that the poptart has been dispensed
+	((Poptart_Dispenser*)this->CurrentContext)->itemDispensed = true;
+	
+	// displays remaining credits
+	this->CurrentContext->output() << "Remaining credit: " << this->CurrentContext->getStateParam(Credit) << "." << endl;
+}
+
+// changes to the next state once the poptart has been dispensed (or couldn't be)
+void DispensesPoptart::leave(void)
+{
+	// if the next customer is waiting they are served once this poptart is collected
+	// (or straight away if nothing was dispensed) rather than the current customer keeping the dispenser
+	if (((Poptart_Dispenser*)this->CurrentContext)->nextCustomerWaiting())
+	{
+		if (((Poptart_Dispenser*)this->CurrentContext)->itemDispensed)
+		{
+			this->CurrentContext->setState(Dispenses_Poptart);	// stays in 'Dispenses_Poptart' until 'getProduct' is called
+		}
+		else
+		{
+			((Poptart_Dispenser*)this->CurrentContext)->serveNextCustomer();
+		}
+		return;
+	}
+
+	// if there's more than 1 credit left in the dispenser
+	// set the current state to 'Has_Credit'
+	if (this->CurrentContext->getStateParam(Credit) > 0)
+	{
+		this->CurrentContext->setState(Has_Credit);
+	}
+	else // else if the user has no credits
+	{
+		// set current state to 'No_Credit'
+		this->CurrentContext->setState(No_Credit);
+	}
+
+	// if there are no poptarts left in the dispenser
+	// set the current state to 'Out_Of_Poptart'
+	if (this->CurrentContext->getStateParam(No_Of_Poptarts) == 0)
+	{
+		this->CurrentContext->setState(Out_Of_Poptart);
+	}
+}
+
+// delivers actuator completions to the dispensers on the controller thread
+// actuators can post completions from any thread, the controller thread calls 'poll'
+// (or waits on 'getFd' in its own event loop) and each dispenser then changes state on that thread
+// so one controller thread can drive many dispensers whose hardware is slow
+// on Linux the wake up is an eventfd, elsewhere a condition variable
+class DispenseReactor
+{
+	mutex completionsLock;									// protects 'completions'
+	vector<pair<Poptart_Dispenser*, bool>> completions;		// dispensers whose actuator has finished and whether it succeeded
+#ifdef __linux__
+	int eventFd;											// readable while completions are waiting
+#else
+	condition_variable completionsReady;					// signalled when a completion is posted
+#endif
+
+public:
+	DispenseReactor(void);
+	~DispenseReactor(void);
+	void post(Poptart_Dispenser* dispenser, bool success);	// queues a completion for 'dispenser', can be called from any thread
+	void cancel(Poptart_Dispenser* dispenser);				// removes any completions queued for 'dispenser'
+	int poll(int timeoutMs);	// waits up to 'timeoutMs' (-1 forever) for completions and delivers them, returns how many
+	int getFd(void);			// returns the eventfd to wait on in another event loop, -1 if there isn't one
+};
+
+DispenseReactor::DispenseReactor(void)
+{
+#ifdef __linux__
+	this->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+}
+
+DispenseReactor::~DispenseReactor(void)
+{
+#ifdef __linux__
+	if (this->eventFd >= 0) close(this->eventFd);
+#endif
+}
+
+void DispenseReactor::post(Poptart_Dispenser* dispenser, bool success)
+{
+	{
+		lock_guard<mutex> lock(this->completionsLock);
+		this->completions.push_back(make_pair(dispenser, success));
+	}
+#ifdef __linux__
+	uint64_t one = 1;
+	ssize_t written = write(this->eventFd, &one, sizeof(one));	// wakes 'poll', the counter only fails to increase if it is already about to be read
+	(void)written;
+#else
+	this->completionsReady.notify_one();
+#endif
+}
+
+void DispenseReactor::cancel(Poptart_Dispenser* dispenser)
+{
+	lock_guard<mutex> lock(this->completionsLock);
+	int kept = 0;
+	for (int i = 0; i < (int)this->completions.size(); i++)
+	{
+		if (this->completions[i].first != dispenser) this->completions[kept++] = this->completions[i];
+	}
+	this->completions.resize(kept);
+}
+
+int DispenseReactor::poll(int timeoutMs)
+{
+	vector<pair<Poptart_Dispenser*, bool>> ready;
+
+#ifdef __linux__
+	pollfd waitFor = { this->eventFd, POLLIN, 0 };
+	if (::poll(&waitFor, 1, timeoutMs) > 0)
+	{
+		uint64_t count;
+		ssize_t drained = read(this->eventFd, &count, sizeof(count));	// resets the counter, the completions themselves are in the queue
+		(void)drained;
+	}
+	{
+		lock_guard<mutex> lock(this->completionsLock);
+		ready.swap(this->completions);
+	}
+#else
+	{
+		unique_lock<mutex> lock(this->completionsLock);
+		if (timeoutMs < 0) this->completionsReady.wait(lock, [this] { return !this->completions.empty(); });
+		else this->completionsReady.wait_for(lock, chrono::milliseconds(timeoutMs), [this] { return !this->completions.empty(); });
+		ready.swap(this->completions);
+	}
+#endif
+
+	// the completions are delivered without the lock held so dispensers can start their next dispense straight away
+	for (int i = 0; i < (int)ready.size(); i++) ready[i].first->completeDispense(ready[i].second);
+	return (int)ready.size();
+}
+
+int DispenseReactor::getFd(void)
+{
+#ifdef __linux__
+	return this->eventFd;
+#else
+	return -1;
+#endif
+}
+
+// pretends to be the dispensing hardware, for testing
+// each dispense completes 'latencyMs' after it was requested and fails with probability 'failureRate'
+// one timer thread serves every dispenser using the actuator and posts their completions to the reactor
+class SimulatedActuator : public Actuator
+{
+	DispenseReactor& reactor;		// reactor completions are posted to
+	int latencyMs;					// time each dispense takes
+	double failureRate;				// chance of each dispense failing, between 0 and 1
+	mutex timerLock;				// protects everything below
+	condition_variable timerWake;	// signalled when a dispense is requested or the actuator is deleted
+	multimap<chrono::steady_clock::time_point, pair<Poptart_Dispenser*, bool>> inProgress;	// dispenses by the time they complete
+	vector<Poptart_Dispenser*> users;	// dispensers attached to the actuator
+	mt19937 random;					// decides which dispenses fail
+	bool stopping = false;			// true once the actuator is being deleted
+	thread timer;					// posts each completion when it is due
+
+	void runTimer(void);
+
+public:
+	SimulatedActuator(DispenseReactor& completions, int latency, double failures, unsigned int seed = 1);
+	~SimulatedActuator(void);	// stops the timer thread and detaches every dispenser using it, must be called on the controller thread
+	void attach(Poptart_Dispenser* dispenser);
+	void request(Poptart_Dispenser* dispenser);
+	void cancel(Poptart_Dispenser* dispenser);
+};
+
+SimulatedActuator::SimulatedActuator(DispenseReactor& completions, int latency, double failures, unsigned int seed)
+	: reactor(completions), latencyMs(latency), failureRate(failures), random(seed)
+{
+	this->timer = thread(&SimulatedActuator::runTimer, this);
+}
+
+SimulatedActuator::~SimulatedActuator(void)
+{
+	{
+		lock_guard<mutex> lock(this->timerLock);
+		this->stopping = true;
+	}
+	this->timerWake.notify_one();
+	this->timer.join();
+
+	// dispenses still in progress (or posted but not yet delivered) will never complete,
+	// so each dispenser fails its dispense now and stops pointing at this actuator
+	for (int i = 0; i < (int)this->users.size(); i++)
+	{
+		this->reactor.cancel(this->users[i]);
+		this->users[i]->detachActuator();
+	}
+}
+
+void SimulatedActuator::attach(Poptart_Dispenser* dispenser)
+{
+	lock_guard<mutex> lock(this->timerLock);
+	this->users.push_back(dispenser);
+}
+
+void SimulatedActuator::request(Poptart_Dispenser* dispenser)
+{
+	{
+		lock_guard<mutex> lock(this->timerLock);
+		bool success = uniform_real_distribution<double>(0.0, 1.0)(this->random) >= this->failureRate;
+		chrono::steady_clock::time_point due = chrono::steady_clock::now() + chrono::milliseconds(this->latencyMs);
+		this->inProgress.insert(make_pair(due, make_pair(dispenser, success)));
+	}
+	this->timerWake.notify_one();
+}
+
+void SimulatedActuator::cancel(Poptart_Dispenser* dispenser)
+{
+	// completions are posted with 'timerLock' held, so once it is taken here
+	// any completion for 'dispenser' is either still in progress or already queued in the reactor
+	lock_guard<mutex> lock(this->timerLock);
+	for (auto dispense = this->inProgress.begin(); dispense != this->inProgress.end();)
+	{
+		if (dispense->second.first == dispenser) dispense = this->inProgress.erase(dispense);
+		else ++dispense;
+	}
+	this->reactor.cancel(dispenser);
+	this->users.erase(remove(this->users.begin(), this->users.end(), dispenser), this->users.end());
+}
+
+void SimulatedActuator::runTimer(void)
+{
+	unique_lock<mutex> lock(this->timerLock);
+	while (!this->stopping)
+	{
+		if (this->inProgress.empty())
+		{
+			this->timerWake.wait(lock);
+			continue;
+		}
+
+		// posts every dispense that is due, then sleeps until the next one is
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		while (!this->inProgress.empty() && this->inProgress.begin()->first <= now)
+		{
+			this->reactor.post(this->inProgress.begin()->second.first, this->inProgress.begin()->second.second);
+			this->inProgress.erase(this->inProgress.begin());
+		}
+		if (!this->inProgress.empty())
+		{
+			chrono::steady_clock::time_point nextDue = this->inProgress.begin()->first;	// copied as 'cancel' can remove the entry while waiting
+			this->timerWake.wait_until(lock, nextDue);
+		}
+	}
+}
+
+// TRACE FORMAT
+// compact on-disk format for dispenser events, written by the 'TraceWriter' and read by the 'TraceReader'
+// all fixed width numbers are little endian
+//
+// file:	"PTRC" magic, 1 byte format version, then the blocks, then the block index, then the footer
+// block:	28 byte header, then the records
+//			header = "PTBK" magic, u32 payload bytes, u32 record count,
+//					 i64 timestamp and u32 dispenser id the first record's deltas are taken from,
+//					 u32 CRC-32 of the rest of the header (after the magic) followed by the payload
+// record:	zigzag varint dispenser id delta, zigzag varint timestamp delta (both from the previous record),
+//			1 byte holding the event type (bits 0-2), accepted (bit 3) and state index (bits 4-5),
+//			zigzag varint argument
+// index:	per block, u64 file offset of its header, i64 first timestamp, u32 record count
+// footer:	u64 file offset of the index, u32 block count, u32 CRC-32 of the index, "PTIX" magic
+//
+// a typical record takes 4-6 bytes compared to around 30 for a fixed width record,
+// and blocks can be found by time through the index without reading the rest of the file
+// every size read back is checked against the length of the file before anything is allocated
+
+static const uint32_t Trace_File_Magic = 0x43525450;	// "PTRC"
+static const uint32_t Trace_Block_Magic = 0x4B425450;	// "PTBK"
+static const uint32_t Trace_Index_Magic = 0x58495450;	// "PTIX"
+static const unsigned char Trace_Version = 2;
+static const int Trace_Block_Header_Size = 28;
+static const int Trace_Index_Entry_Size = 20;
+static const int Trace_Footer_Size = 20;
+
+// maps signed values to unsigned ones so small negative deltas also stay small e.g. -1 = 1, 1 = 2
+inline uint64_t zigzagEncode(int64_t value) { return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63); }
+inline int64_t zigzagDecode(uint64_t value) { return (int64_t)(value >> 1) ^ -(int64_t)(value & 1); }
+
+// appends 'value' using 7 bits per byte, the top bit of each byte says whether another byte follows
+inline void putVarint(vector<unsigned char>& buffer, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		buffer.push_back((unsigned char)(value | 0x80));
+		value >>= 7;
+	}
+	buffer.push_back((unsigned char)value);
+}
+
+// reads a varint starting at 'position', returns false if it runs past 'end'
+inline bool getVarint(const unsigned char*& position, const unsigned char* end, uint64_t& value)
+{
+	if (position < end && *position < 0x80)	// most deltas fit in a single byte
+	{
+		value = *position++;
+		return true;
+	}
+
+	value = 0;
+	for (int shift = 0; position < end && shift < 64; shift += 7)
+	{
+		unsigned char byte = *position++;
+		value |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return true;
+	}
 	return false;
 }
 
-// HasCredit State
-// Inserts credit to the dispenser from the 'HasCredit' state
-// which also adds to the current total amount
-bool HasCredit::insertMoney(int money)
+// appends 'bytes' bytes of 'value' in little endian order
+inline void putFixed(vector<unsigned char>& buffer, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; i++) buffer.push_back((unsigned char)(value >> (8 * i)));
+}
+
+// reads 'bytes' bytes in little endian order
+inline uint64_t getFixed(const unsigned char* data, int bytes)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < bytes; i++) value |= (uint64_t)data[i] << (8 * i);
+	return value;
+}
+
+// returns the CRC-32 (IEEE) checksum of 'length' bytes starting at 'data'
+// passing the checksum of the bytes before as 'previous' gives the checksum of both together
+// works through 8 bytes at a time using 8 lookup tables (slicing-by-8) so checking
+// a block costs much less than decoding it
+uint32_t traceChecksum(const unsigned char* data, size_t length, uint32_t previous = 0)
+{
+	// the tables are built the first time a checksum is needed
+	struct ChecksumTables
+	{
+		uint32_t values[8][256];
+		ChecksumTables(void)
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t value = i;
+				for (int bit = 0; bit < 8; bit++) value = (value & 1) ? 0xEDB88320 ^ (value >> 1) : value >> 1;
+				values[0][i] = value;
+			}
+			for (int slice = 1; slice < 8; slice++)
+			{
+				for (int i = 0; i < 256; i++) values[slice][i] = (values[slice - 1][i] >> 8) ^ values[0][values[slice - 1][i] & 0xFF];
+			}
+		}
+	};
+	static const ChecksumTables tables;
+	const uint32_t (*table)[256] = tables.values;
+
+	uint32_t crc = previous ^ 0xFFFFFFFF;
+	for (; length >= 8; data += 8, length -= 8)
+	{
+		uint32_t low = crc ^ (uint32_t)getFixed(data, 4);
+		uint32_t high = (uint32_t)getFixed(data + 4, 4);
+		crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24]
+			^ table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+	}
+	for (; length > 0; data++, length--) crc = table[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
+
+// position of a block in the trace file and what it holds
+struct TraceBlockInfo
+{
+	uint64_t offset;			// file offset of the block header
+	int64_t firstTimestamp;		// timestamp of the first record in the block
+	uint32_t recordCount;		// number of records in the block
+};
+
+// writes dispenser events to 'out' in the trace format
+// add it to each dispenser with 'addListener', events are buffered and written a block at a time
+// the writer isn't thread safe, use one writer per thread (or per file) when dispensers run on several threads
+class TraceWriter : public DispenserListener
+{
+	ostream& out;						// stream the trace is written to, opened in binary mode
+	int recordsPerBlock;				// number of records buffered before a block is written
+	vector<unsigned char> payload;		// records in the block being built
+	uint32_t blockRecords = 0;			// number of records in 'payload'
+	int64_t blockTimestamp = 0;			// timestamp the block's first delta is taken from
+	uint32_t blockDispenser = 0;		// dispenser id the block's first delta is taken from
+	int64_t lastTimestamp = 0;			// timestamp of the previous record in the block
+	uint32_t lastDispenser = 0;			// dispenser id of the previous record in the block
+	uint64_t offset = 0;				// number of bytes written so far
+	vector<TraceBlockInfo> blocks;		// index of every block written
+	bool closed = false;
+
+	void writeBytes(const vector<unsigned char>& bytes);	// writes 'bytes' to 'out' and moves 'offset' on
+	void flushBlock(void);									// writes the block being built, if it has any records
+
+public:
+	TraceWriter(ostream& output, int blockSize = 4096);	// constructor which writes the file header
+	~TraceWriter(void);									// closes the trace if 'close' hasn't been called
+	void onEvent(const DispenserRecord& record);		// adds 'record' to the block being built
+	void close(void);									// writes the last block, the index and the footer
+};
+
+TraceWriter::TraceWriter(ostream& output, int blockSize) : out(output)
+{
+	this->recordsPerBlock = blockSize > 0 ? blockSize : 1;
+	vector<unsigned char> header;
+	putFixed(header, Trace_File_Magic, 4);
+	header.push_back(Trace_Version);
+	this->writeBytes(header);
+}
+
+TraceWriter::~TraceWriter(void)
+{
+	this->close();
+}
+
+void TraceWriter::writeBytes(const vector<unsigned char>& bytes)
+{
+	this->out.write((const char*)bytes.data(), bytes.size());
+	this->offset += bytes.size();
+}
+
+void TraceWriter::onEvent(const DispenserRecord& record)
+{
+	if (this->closed) return;
+
+	if (this->blockRecords == 0)	// the first record of a block is taken from the values in the header
+	{
+		this->blockTimestamp = this->lastTimestamp = record.timestamp;
+		this->blockDispenser = this->lastDispenser = record.dispenserId;
+	}
+
+	putVarint(this->payload, zigzagEncode((int64_t)record.dispenserId - (int64_t)this->lastDispenser));
+	putVarint(this->payload, zigzagEncode(record.timestamp - this->lastTimestamp));
+	this->payload.push_back((unsigned char)(record.type | (record.accepted ? 8 : 0) | (record.stateIndex << 4)));
+	putVarint(this->payload, zigzagEncode(record.argument));
+
+	this->lastTimestamp = record.timestamp;
+	this->lastDispenser = record.dispenserId;
+	if (++this->blockRecords >= (uint32_t)this->recordsPerBlock) this->flushBlock();
+}
+
+void TraceWriter::flushBlock(void)
+{
+	if (this->blockRecords == 0) return;
+
+	TraceBlockInfo info;
+	info.offset = this->offset;
+	info.firstTimestamp = this->blockTimestamp;
+	info.recordCount = this->blockRecords;
+	this->blocks.push_back(info);
+
+	vector<unsigned char> header;
+	putFixed(header, Trace_Block_Magic, 4);
+	putFixed(header, this->payload.size(), 4);
+	putFixed(header, this->blockRecords, 4);
+	putFixed(header, (uint64_t)this->blockTimestamp, 8);
+	putFixed(header, this->blockDispenser, 4);
+	uint32_t checksum = traceChecksum(header.data() + 4, header.size() - 4);	// a damaged header fails the checksum as well as a damaged payload
+	putFixed(header, traceChecksum(this->payload.data(), this->payload.size(), checksum), 4);
+	this->writeBytes(header);
+	this->writeBytes(this->payload);
+
+	this->payload.clear();
+	this->blockRecords = 0;
+}
+
+void TraceWriter::close(void)
+{
+	if (this->closed) return;
+	this->flushBlock();
+
+	vector<unsigned char> index;
+	uint64_t indexOffset = this->offset;
+	for (int i = 0; i < (int)this->blocks.size(); i++)
+	{
+		putFixed(index, this->blocks[i].offset, 8);
+		putFixed(index, (uint64_t)this->blocks[i].firstTimestamp, 8);
+		putFixed(index, this->blocks[i].recordCount, 4);
+	}
+	uint32_t checksum = traceChecksum(index.data(), index.size());
+	putFixed(index, indexOffset, 8);
+	putFixed(index, this->blocks.size(), 4);
+	putFixed(index, checksum, 4);
+	putFixed(index, Trace_Index_Magic, 4);
+	this->writeBytes(index);
+	this->out.flush();
+	this->closed = true;
+}
+
+// reads a trace written by the 'TraceWriter'
+// the block index is loaded when the trace is opened, so any block can be read on its own
+class TraceReader
+{
+	istream& in;						// stream the trace is read from, opened in binary mode
+	vector<TraceBlockInfo> blocks;		// index of every block in the trace
+	vector<unsigned char> buffer;		// header and payload of the last block read
+	uint64_t fileSize = 0;				// length of the trace in bytes
+	uint64_t indexOffset = 0;			// where the block index starts, every block has to end before it
+	bool valid = false;
+
+public:
+	TraceReader(istream& input);		// constructor which checks the file header and loads the block index
+	bool isValid(void);					// returns false if the trace couldn't be opened
+	int getBlockCount(void);			// returns the number of blocks in the trace
+	TraceBlockInfo getBlock(int block);	// returns where block 'block' is and what it holds
+	int findBlock(int64_t timestamp);	// returns the last block starting at or before 'timestamp', 0 if there isn't one
+	bool readBlock(int block, vector<DispenserRecord>& records);	// adds the records in 'block' to 'records', false if it is damaged
+	bool readAll(vector<DispenserRecord>& records);					// adds every record in the trace to 'records'
+};
+
+TraceReader::TraceReader(istream& input) : in(input)
+{
+	unsigned char header[5];
+	if (!this->in.read((char*)header, 5) || getFixed(header, 4) != Trace_File_Magic || header[4] != Trace_Version) return;
+
+	if (!this->in.seekg(0, ios::end)) return;
+	this->fileSize = (uint64_t)this->in.tellg();
+	if (this->fileSize < 5 + Trace_Footer_Size) return;
+
+	unsigned char footer[Trace_Footer_Size];
+	if (!this->in.seekg(-Trace_Footer_Size, ios::end) || !this->in.read((char*)footer, Trace_Footer_Size)) return;
+	if (getFixed(footer + 16, 4) != Trace_Index_Magic) return;	// if the footer is missing the trace wasn't closed
+
+	// the index sits between the last block and the footer, so a damaged offset or count is caught before allocating it
+	this->indexOffset = getFixed(footer, 8);
+	uint32_t blockCount = (uint32_t)getFixed(footer + 8, 4);
+	if (this->indexOffset < 5 || this->indexOffset > this->fileSize - Trace_Footer_Size) return;
+	if ((uint64_t)blockCount * Trace_Index_Entry_Size != this->fileSize - Trace_Footer_Size - this->indexOffset) return;
+
+	vector<unsigned char> index((size_t)blockCount * Trace_Index_Entry_Size);
+	if (!this->in.seekg(this->indexOffset) || !this->in.read((char*)index.data(), index.size())) return;
+	if (traceChecksum(index.data(), index.size()) != (uint32_t)getFixed(footer + 12, 4)) return;	// the index is damaged
+
+	for (uint32_t i = 0; i < blockCount; i++)
+	{
+		const unsigned char* entry = index.data() + (size_t)i * Trace_Index_Entry_Size;
+		TraceBlockInfo info;
+		info.offset = getFixed(entry, 8);
+		info.firstTimestamp = (int64_t)getFixed(entry + 8, 8);
+		info.recordCount = (uint32_t)getFixed(entry + 16, 4);
+		this->blocks.push_back(info);
+	}
+	this->valid = true;
+}
+
+bool TraceReader::isValid(void)
+{
+	return this->valid;
+}
+
+int TraceReader::getBlockCount(void)
+{
+	return (int)this->blocks.size();
+}
+
+TraceBlockInfo TraceReader::getBlock(int block)
+{
+	return this->blocks[block];
+}
+
+int TraceReader::findBlock(int64_t timestamp)
+{
+	// binary search over the first timestamp of each block
+	int low = 0;
+	int high = (int)this->blocks.size() - 1;
+	int found = 0;
+	while (low <= high)
+	{
+		int middle = low + (high - low) / 2;
+		if (this->blocks[middle].firstTimestamp <= timestamp)
+		{
+			found = middle;
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle - 1;
+		}
+	}
+	return found;
+}
+
+bool TraceReader::readBlock(int block, vector<DispenserRecord>& records)
+{
+	if (block < 0 || block >= (int)this->blocks.size()) return false;
+
+	unsigned char header[Trace_Block_Header_Size];
+	this->in.clear();
+	// the block has to sit between the file header and the index, each bound is checked
+	// before it is subtracted from so a damaged offset or size can't wrap around
+	uint64_t offset = this->blocks[block].offset;
+	if (offset < 5 || offset > this->indexOffset || this->indexOffset - offset < Trace_Block_Header_Size) return false;
+	if (!this->in.seekg(offset) || !this->in.read((char*)header, Trace_Block_Header_Size)) return false;
+	if (getFixed(header, 4) != Trace_Block_Magic) return false;
+
+	// every record takes at least 4 bytes and the payload has to fit before the index
+	uint32_t payloadSize = (uint32_t)getFixed(header + 4, 4);
+	uint32_t recordCount = (uint32_t)getFixed(header + 8, 4);
+	if (payloadSize > this->indexOffset - offset - Trace_Block_Header_Size || recordCount > payloadSize / 4) return false;
+
+	this->buffer.resize(payloadSize);
+	if (!this->in.read((char*)this->buffer.data(), payloadSize)) return false;
+	uint32_t checksum = traceChecksum(header + 4, Trace_Block_Header_Size - 8);
+	if (traceChecksum(this->buffer.data(), payloadSize, checksum) != (uint32_t)getFixed(header + 24, 4)) return false;	// the block is damaged
+
+	// the index is only used to find the block, so it must agree with the checked header
+	if (recordCount != this->blocks[block].recordCount) return false;
+
+	int64_t timestamp = (int64_t)getFixed(header + 12, 8);
+	int64_t dispenser = (int64_t)getFixed(header + 20, 4);
+	if (timestamp != this->blocks[block].firstTimestamp) return false;
+	const unsigned char* position = this->buffer.data();
+	const unsigned char* end = position + payloadSize;
+	if (records.capacity() < records.size() + recordCount)	// grows geometrically so reading block by block stays linear
+	{
+		records.reserve(max(records.size() + recordCount, records.capacity() * 2));
+	}
+
+	for (uint32_t i = 0; i < recordCount; i++)
+	{
+		uint64_t dispenserDelta, timestampDelta, argument;
+		if (!getVarint(position, end, dispenserDelta) || !getVarint(position, end, timestampDelta) || position >= end) return false;
+		unsigned char flags = *position++;
+		if (!getVarint(position, end, argument)) return false;
+
+		dispenser += zigzagDecode(dispenserDelta);
+		timestamp += zigzagDecode(timestampDelta);
+
+		DispenserRecord record;
+		record.dispenserId = (uint32_t)dispenser;
+		record.timestamp = timestamp;
+		record.type = (dispenserEvent)(flags & 7);
+		record.accepted = (flags & 8) != 0;
+		record.stateIndex = (flags >> 4) & 3;
+		record.argument = (int)zigzagDecode(argument);
+		records.push_back(record);
+	}
+	return true;
+}
+
+bool TraceReader::readAll(vector<DispenserRecord>& records)
+{
+	for (int i = 0; i < (int)this->blocks.size(); i++)
+	{
+		if (!this->readBlock(i, records)) return false;
+	}
+	return true;
+}
+
+// RESTOCK PLANNING
+// helpers for spreading work over every core, and the planner that uses them to decide which dispensers to restock
+
+// runs 'work' over [0, count) split into one contiguous chunk per core
+// 'work' is given the start and end of its chunk and must only touch that part of any shared output
+void parallelFor(size_t count, const function<void(size_t begin, size_t end)>& work)
 {
-	cout << "Inserting: " << money;
-	money = money + this->CurrentContext->getStateParam(Credit);	// 'money' is equal to 'money' + the current credit stored in the 'stateParam' vector using the index 'Credit'  
-	this->CurrentContext->setStateParam(Credit, money);	// inserts the 'money' into the 'setStateParam' vector using index 'Credit'
-	cout << "\n New Total: " << money << endl;
-	this->CurrentContext->setState(Has_Credit);	// changes state to 'Has_Credit' as user now has sufficient credit
-	return true;
+	if (count == 0) return;
+	size_t threads = max(1u, thread::hardware_concurrency());
+	if (threads > count) threads = count;
+	if (threads == 1)	// not worth starting a thread for
+	{
+		work(0, count);
+		return;
+	}
+
+	vector<thread> workers;
+	size_t chunk = (count + threads - 1) / threads;
+	for (size_t begin = 0; begin < count; begin += chunk) workers.push_back(thread(work, begin, min(begin + chunk, count)));
+	for (int i = 0; i < (int)workers.size(); i++) workers[i].join();
 }
 
-// Allows the user to select their poptart base and filling
-// using the 'option' argument ready for dispensing
-// uses bitmasking in order to allow the user to select a base
-// and multiple fillings using 1 option code argument
-bool HasCredit::makeSelection(int option)
+// sorts 'items' using every core, each core sorts a chunk then the chunks are merged in pairs
+template <class T, class Compare>
+void parallelSort(vector<T>& items, Compare compare)
 {
-	cout << "Selection made!" << endl;
-	if (!((Poptart_Dispenser*)this->CurrentContext)->itemRetrieved)	// if no poptart has been retrieved
+	size_t threads = max(1u, thread::hardware_concurrency());
+	size_t chunk = (items.size() + threads - 1) / threads;
+	if (threads == 1 || chunk < 1024)	// small inputs are quicker to sort on one core
 	{
-		delete ((Poptart_Dispenser*)this->CurrentContext)->DispensedItem;	// deletes the previous dispensed poptart
+		sort(items.begin(), items.end(), compare);
+		return;
 	}
-	
-	// selecting a base with multiple different fillings can be done via the use of bitmasking
-	// e.g. if I wanted a poptart with the base plain (1) and the fillings blackberry (1024) and banana (64)
-	// you pass '1089' to the option code allowing the selection of the base and multiple fillings specified
 
-	// BASES
-	// bases can only be selected once therefore the use of if else statements only are acceptable here
-	if (option & 1)
+	size_t chunks = (items.size() + chunk - 1) / chunk;
+	parallelFor(chunks, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++) sort(items.begin() + i * chunk, items.begin() + min((i + 1) * chunk, items.size()), compare);
+	});
+
+	// each round merges neighbouring sorted runs, doubling their length
+	for (size_t run = chunk; run < items.size(); run *= 2)
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new PlainBase();	// set the DispensedItem to the specified base
+		size_t pairs = (items.size() + 2 * run - 1) / (2 * run);
+		parallelFor(pairs, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				size_t first = i * 2 * run;
+				size_t middle = min(first + run, items.size());
+				size_t last = min(first + 2 * run, items.size());
+				inplace_merge(items.begin() + first, items.begin() + middle, items.begin() + last, compare);
+			}
+		});
 	}
-	else if (option & 2)
+}
+
+// works out how quickly each dispenser sells poptarts from its 'Dispense' events
+// add it to each dispenser with 'addListener', or give it records read back with the 'TraceReader'
+// the tracker isn't thread safe, use one per thread and 'merge' them
+class SalesTracker : public DispenserListener
+{
+	map<uint32_t, long long> sales;		// number of poptarts dispensed by each dispenser
+	int64_t firstTimestamp = 0;			// time of the first event seen
+	int64_t lastTimestamp = 0;			// time of the last event seen
+	bool seenEvent = false;
+
+public:
+	void onEvent(const DispenserRecord& record);			// counts 'record' if a poptart was dispensed
+	void addRecords(const vector<DispenserRecord>& records);	// counts every record e.g. from a trace file
+	void merge(const SalesTracker& other);					// adds the sales counted by 'other'
+	long long getSales(uint32_t dispenserId);				// returns the number of poptarts 'dispenserId' has dispensed
+	double getWindowHours(void);							// returns the number of hours between the first and last event seen
+	double getSalesRate(uint32_t dispenserId);				// returns the poptarts sold per hour by 'dispenserId'
+};
+
+void SalesTracker::onEvent(const DispenserRecord& record)
+{
+	if (!this->seenEvent || record.timestamp < this->firstTimestamp) this->firstTimestamp = record.timestamp;
+	if (!this->seenEvent || record.timestamp > this->lastTimestamp) this->lastTimestamp = record.timestamp;
+	this->seenEvent = true;
+	if (record.type == Dispense && record.accepted) this->sales[record.dispenserId]++;
+}
+
+void SalesTracker::addRecords(const vector<DispenserRecord>& records)
+{
+	for (int i = 0; i < (int)records.size(); i++) this->onEvent(records[i]);
+}
+
+void SalesTracker::merge(const SalesTracker& other)
+{
+	if (!other.seenEvent) return;
+	if (!this->seenEvent || other.firstTimestamp < this->firstTimestamp) this->firstTimestamp = other.firstTimestamp;
+	if (!this->seenEvent || other.lastTimestamp > this->lastTimestamp) this->lastTimestamp = other.lastTimestamp;
+	this->seenEvent = true;
+	for (auto sold = other.sales.begin(); sold != other.sales.end(); ++sold) this->sales[sold->first] += sold->second;
+}
+
+long long SalesTracker::getSales(uint32_t dispenserId)
+{
+	auto sold = this->sales.find(dispenserId);
+	return sold == this->sales.end() ? 0 : sold->second;
+}
+
+double SalesTracker::getWindowHours(void)
+{
+	return (this->lastTimestamp - this->firstTimestamp) / 3600000000.0;	// timestamps are in microseconds
+}
+
+double SalesTracker::getSalesRate(uint32_t dispenserId)
+{
+	double hours = this->getWindowHours();
+	if (hours <= 0) return 0;	// if no time has passed there's no rate to work out
+	return this->getSales(dispenserId) / hours;
+}
+
+// stock and sales of one dispenser at the time the plan is made
+struct RestockSnapshot
+{
+	uint32_t dispenserId;	// id of the dispenser
+	int route;				// delivery route the dispenser is on
+	int poptarts;			// poptarts left in the dispenser (No_Of_Poptarts)
+	int capacity;			// most poptarts the dispenser can hold
+	double salesPerHour;	// poptarts sold per hour e.g. from the 'SalesTracker'
+};
+
+// a visit to one dispenser on a route
+struct RestockStop
+{
+	uint32_t dispenserId;		// id of the dispenser
+	int quantity;				// poptarts to load with 'addPoptart'
+	int shortfall;				// poptarts that were needed but didn't fit on the truck
+	double hoursUntilEmpty;		// hours until the dispenser runs out at its current sales rate
+};
+
+// the stops for one route, in the order they should be visited
+struct RoutePlan
+{
+	int route;					// delivery route
+	int priority;				// 1 for the most urgent route, 2 for the next and so on
+	int totalQuantity;			// poptarts the truck needs to carry
+	int totalShortfall;			// poptarts needed on the route that didn't fit on the truck
+	double earliestEmpty;		// hours until the first dispenser on the route runs out
+	vector<RestockStop> stops;	// dispensers to visit, most urgent first
+};
+
+// plans how many poptarts to load into each dispenser and which routes to drive first
+// 'addPoptart' is only accepted once a dispenser is 'Out_Of_Poptart' and sets its stock,
+// so a dispenser that will run out within 'horizonHours' is loaded with enough for the next
+// 'horizonHours' of sales (up to its capacity), and each route's truck carries at most 'truckCapacity'
+// every step runs across all cores, planning a fleet of hundreds of thousands takes well under a second
+class RestockPlanner
+{
+	double horizonHours;	// hours ahead the plan covers
+	int truckCapacity;		// most poptarts one truck can carry on a route
+
+public:
+	RestockPlanner(double horizon, int truckLoad);
+	vector<RoutePlan> plan(const vector<RestockSnapshot>& fleet);	// returns the routes that need driving, most urgent first
+};
+
+RestockPlanner::RestockPlanner(double horizon, int truckLoad)
+{
+	horizonHours = horizon;
+	truckCapacity = truckLoad;
+}
+
+vector<RoutePlan> RestockPlanner::plan(const vector<RestockSnapshot>& fleet)
+{
+	// an order for one dispenser before it is grouped into a route
+	struct RestockNeed
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new SpicyBase();
+		int route;
+		RestockStop stop;
+	};
+
+	// works out what each dispenser needs, every dispenser is independent so they're split across the cores
+	vector<RestockNeed> needs(fleet.size());
+	vector<char> needsVisit(fleet.size(), 0);
+	parallelFor(fleet.size(), [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			const RestockSnapshot& dispenser = fleet[i];
+			double hoursUntilEmpty = 1e300;	// a dispenser that isn't selling never runs out
+			if (dispenser.poptarts <= 0) hoursUntilEmpty = 0;	// an empty dispenser has already run out, however slowly it sells
+			else if (dispenser.salesPerHour > 0) hoursUntilEmpty = dispenser.poptarts / dispenser.salesPerHour;
+			if (hoursUntilEmpty > this->horizonHours) continue;	// if it won't run out it doesn't need a visit
+
+			// a dispenser with no sales yet (e.g. new, or empty for the whole tracking window) is filled up as there's no rate to go on
+			int demand = (int)ceil(dispenser.salesPerHour * this->horizonHours);
+			if (demand <= 0) demand = dispenser.capacity - max(0, dispenser.poptarts);
+			needs[i].route = dispenser.route;
+			needs[i].stop.dispenserId = dispenser.dispenserId;
+			needs[i].stop.quantity = max(1, min(dispenser.capacity, demand));
+			needs[i].stop.shortfall = 0;
+			needs[i].stop.hoursUntilEmpty = hoursUntilEmpty;
+			needsVisit[i] = 1;
+		}
+	});
+
+	int kept = 0;
+	for (size_t i = 0; i < fleet.size(); i++)
+	{
+		if (needsVisit[i]) needs[kept++] = needs[i];
 	}
-	else if (option & 4)
+	needs.resize(kept);
+
+	// groups the dispensers by route with the most urgent first
+	parallelSort(needs, [](const RestockNeed& a, const RestockNeed& b)
+	{
+		if (a.route != b.route) return a.route < b.route;
+		return a.stop.hoursUntilEmpty < b.stop.hoursUntilEmpty;
+	});
+
+	vector<size_t> routeStarts;
+	for (size_t i = 0; i < needs.size(); i++)
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new ChocolateBase();
+		if (i == 0 || needs[i].route != needs[i - 1].route) routeStarts.push_back(i);
 	}
-	else if (option & 8)
+	routeStarts.push_back(needs.size());
+
+	// loads each route's truck, most urgent dispensers first, routes are independent so they're split across the cores
+	vector<RoutePlan> routes(routeStarts.size() - 1);
+	parallelFor(routes.size(), [&](size_t begin, size_t end)
+	{
+		for (size_t r = begin; r < end; r++)
+		{
+			RoutePlan& route = routes[r];
+			route.route = needs[routeStarts[r]].route;
+			route.totalQuantity = 0;
+			route.totalShortfall = 0;
+			route.earliestEmpty = needs[routeStarts[r]].stop.hoursUntilEmpty;
+
+			int spaceLeft = this->truckCapacity;
+			for (size_t i = routeStarts[r]; i < routeStarts[r + 1]; i++)
+			{
+				RestockStop stop = needs[i].stop;
+				int loaded = min(stop.quantity, spaceLeft);
+				stop.shortfall = stop.quantity - loaded;
+				stop.quantity = loaded;
+				spaceLeft -= loaded;
+				route.totalQuantity += stop.quantity;
+				route.totalShortfall += stop.shortfall;
+				route.stops.push_back(stop);
+			}
+		}
+	});
+
+	// the route whose first dispenser runs out soonest is driven first
+	sort(routes.begin(), routes.end(), [](const RoutePlan& a, const RoutePlan& b) { return a.earliestEmpty < b.earliestEmpty; });
+	for (int i = 0; i < (int)routes.size(); i++) routes[i].priority = i + 1;
+	return routes;
+}
+
+// STATE EXPLORER
+// model checks the dispenser by driving the real state classes through every configuration they can reach
+
+// the values each event is tried with while exploring and how far the exploration goes
+// pipelining and the actuator are left off, the explorer checks the single customer state machine
+struct ExplorerBounds
+{
+	vector<int> money = { 25, 50, 100 };	// amounts tried with 'insertMoney'
+	vector<int> options = { PlainBase::optionCode, SpicyBase::optionCode, 1089, ChocolateFilling::optionCode };	// option codes tried with 'makeSelection', at most 255
+	vector<int> restock = { 1, 2, 5 };		// numbers of poptarts tried with 'addPoptart', at most 32767
+	int startingStock = 0;					// poptarts the dispenser is created with
+	int maxCredit = 500;					// configurations with more credit than this aren't explored
+	int tableBits = 24;						// the visited set grows as configurations are found up to 2^tableBits of them (8 bytes each)
+};
+
+// one configuration of the dispenser as the explorer sees it
+struct ExplorerConfig
+{
+	int stateIndex;			// state the dispenser is in
+	int credit;				// credit held
+	int poptarts;			// poptarts left
+	int selection;			// position in 'ExplorerBounds::options' of the selected poptart plus 1, 0 if nothing is selected
+	bool itemDispensed;		// true if a poptart is waiting to be collected
+	bool itemRetrieved;		// true if the selected poptart has been collected and belongs to the customer
+};
+
+// stands in for the selected poptart while exploring, so loading a configuration doesn't build a poptart
+// it behaves like the poptart the explorer built once for the option and notes when it is deleted, as the dispenser
+// must never delete a poptart once 'getProduct' has handed it to the customer
+// deleting it doesn't free it, each worker keeps one and rebuilds it in place after it is deleted
+class ExplorerPoptart : public Product
+{
+	bool* deleted;		// set to true when this poptart is deleted
+
+public:
+	Product* poptart = nullptr;	// poptart built for the selected option, owned by the explorer
+
+	ExplorerPoptart(bool* deletedFlag)
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new CoconutBase();
+		deleted = deletedFlag;
 	}
-	else if (option & 16)
+	~ExplorerPoptart(void)
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new FruityBase();
+		*deleted = true;
 	}
-	
-	// FILLINGS
-	// as fillings can be selected more than once, the use of if statements only are acceptable here
-	if (option & 32)
+	static void operator delete(void*) {}	// the worker owns the memory
+	int cost(void) { return this->poptart->cost(); }
+	string description(void) { return this->poptart->description(); }
+};
+
+// explores every configuration of a 'Poptart_Dispenser' reachable within 'ExplorerBounds'
+// each configuration is packed into 64 bits and the frontier is expanded a level at a time across all cores,
+// every worker loads configurations into its own dispenser and applies each event through the public methods
+// so the real state classes decide where each event leads
+// an event breaking an invariant is recorded and where it leads isn't explored further
+// the state classes print every step, so each worker's dispenser writes to a stream that discards it
+class StateExplorer
+{
+	static const int Invariant_Count = Collected_Poptart_Reclaimed + 1;	// number of invariants checked
+	static const int Shape_Count = (Dispenses_Poptart + 1) * 8;		// number of combinations of state, selection, dispensed and retrieved
+	static const int Prefetch_Distance = 8;							// number of candidates ahead the visited set is loaded
+
+	// counts kept by each worker while expanding and added together at the end of each level
+	struct ExplorerTally
+	{
+		long long transitions = 0;						// events applied
+		long long clipped = 0;							// events leading past 'maxCredit'
+		long long deadEnds = 0;							// configurations no event leads out of
+		uint64_t deadEndExample = 0;					// first dead end found, 0 if there are none
+		long long violations[Invariant_Count] = {};			// events breaking each invariant
+		uint64_t violationExamples[Invariant_Count] = {};	// configuration the first event breaking each invariant was applied to
+		dispenserEvent violationEvents[Invariant_Count] = {};	// first event found breaking each invariant
+		bool reached[Shape_Count] = {};					// combinations of state, selection, dispensed and retrieved seen
+	};
+
+	ExplorerBounds bounds;					// event arguments and limits
+	PriceBoard board;						// prices used by the dispensers being explored, the catalogue prices
+	PriceTable prices;						// copy of the prices the selected poptarts are built with
+	vector<Product*> selections;			// poptart built for each option in 'bounds.options', nullptr if the option doesn't select a base
+	vector<atomic<uint64_t>> visited;		// open addressing set of every configuration found, 0 marks an empty slot
+	atomic<bool> tableFull;					// true if a configuration couldn't be added because 'visited' was full
+	ExplorerTally totals;					// counts from every level explored
+	long long visitedCount = 0;				// configurations found
+	int depth = 0;							// number of levels explored
+	double seconds = 0;						// time taken by 'explore'
+
+	uint64_t encode(const ExplorerConfig& config);	// packs 'config' into 64 bits, never 0
+	ExplorerConfig decode(uint64_t key);			// unpacks a configuration packed by 'encode'
+	int shape(const ExplorerConfig& config);		// returns the combination of state, selection, dispensed and retrieved in 'config'
+	string describe(uint64_t key);					// returns a readable description of a configuration
+	size_t hashSlot(uint64_t key);					// returns the slot in 'visited' the search for 'key' starts at
+	void prefetch(uint64_t key);					// starts loading the slot for 'key' into the cache
+	bool markVisited(uint64_t key);					// adds 'key' to the visited set, returns false if it was already there
+	void reserve(size_t configurations);			// grows the visited set (up to 2^tableBits slots) so it can hold 'configurations' at half full
+	uint64_t step(Poptart_Dispenser& dispenser, ExplorerPoptart& loaded, bool& loadedDeleted, const ExplorerConfig& from, dispenserEvent type, int choice, int& broken);	// applies one event to 'from'
+	void expand(Poptart_Dispenser& dispenser, ExplorerPoptart& loaded, bool& loadedDeleted, uint64_t key, vector<uint64_t>& candidates, ExplorerTally& tally);	// applies every event to 'key' adding where they lead to 'candidates'
+
+public:
+	StateExplorer(const ExplorerBounds& limits);
+	~StateExplorer(void);
+	bool explore(void);				// explores from a newly created dispenser, returns true if no invariant was broken
+	void report(ostream& out);		// writes what was found e.g. to 'cout'
+	long long getVisitedCount(void);			// returns the number of configurations found
+	long long getTransitionCount(void);			// returns the number of events applied
+	long long getDeadEndCount(void);			// returns the number of configurations no event leads out of
+	long long getViolationCount(invariant check);	// returns the number of events breaking 'check'
+};
+
+StateExplorer::StateExplorer(const ExplorerBounds& limits) : visited((size_t)1 << 10)
+{
+	bounds = limits;
+	bounds.tableBits = min(max(bounds.tableBits, 10), 34);
+	if (bounds.options.size() > 255)
 	{
-		// adds a filling to the DispensedItem (poptart/product) by creating a new object and casting it to DispensedItem
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new ChocolateFilling(((Poptart_Dispenser*)this->CurrentContext)->DispensedItem);
+		cout << "Error! Only the first 255 options can be explored!" << endl;
+		bounds.options.resize(255);
 	}
-	if (option & 64)
+	prices = board.read();
+	for (int i = 0; i < (int)bounds.options.size(); i++) selections.push_back(decodeSelection(bounds.options[i], prices));
+	tableFull.store(false);
+}
+
+StateExplorer::~StateExplorer(void)
+{
+	for (int i = 0; i < (int)this->selections.size(); i++) delete this->selections[i];
+}
+
+// bits 0-31 credit, 32-47 poptarts, 48-55 selection, 56 dispensed, 57 retrieved, 58-59 state, 63 always set
+uint64_t StateExplorer::encode(const ExplorerConfig& config)
+{
+	return (uint64_t)(uint32_t)config.credit
+		| (uint64_t)(uint16_t)config.poptarts << 32
+		| (uint64_t)config.selection << 48
+		| (uint64_t)config.itemDispensed << 56
+		| (uint64_t)config.itemRetrieved << 57
+		| (uint64_t)config.stateIndex << 58
+		| (uint64_t)1 << 63;
+}
+
+ExplorerConfig StateExplorer::decode(uint64_t key)
+{
+	ExplorerConfig config;
+	config.credit = (int32_t)(uint32_t)key;
+	config.poptarts = (int16_t)(uint16_t)(key >> 32);
+	config.selection = (int)(key >> 48) & 0xFF;
+	config.itemDispensed = (key >> 56) & 1;
+	config.itemRetrieved = (key >> 57) & 1;
+	config.stateIndex = (int)(key >> 58) & 3;
+	return config;
+}
+
+int StateExplorer::shape(const ExplorerConfig& config)
+{
+	return config.stateIndex * 8 + (config.selection > 0) * 4 + config.itemDispensed * 2 + config.itemRetrieved;
+}
+
+string StateExplorer::describe(uint64_t key)
+{
+	static const char* stateNames[] = { "Out_Of_Poptart", "No_Credit", "Has_Credit", "Dispenses_Poptart" };
+	ExplorerConfig config = this->decode(key);
+	string text = string(stateNames[config.stateIndex]) + " credit " + to_string(config.credit) + " poptarts " + to_string(config.poptarts);
+	text += config.selection > 0 ? " selected " + to_string(this->bounds.options[config.selection - 1]) : " nothing selected";
+	if (config.itemDispensed) text += " dispensed";
+	if (config.itemRetrieved) text += " collected";
+	return text;
+}
+
+// mixes the bits of the key so neighbouring configurations are spread across the table
+size_t StateExplorer::hashSlot(uint64_t key)
+{
+	uint64_t hash = key;
+	hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+	hash = hash ^ (hash >> 31);
+	return hash & (this->visited.size() - 1);
+}
+
+void StateExplorer::prefetch(uint64_t key)
+{
+#if defined(__GNUC__)
+	__builtin_prefetch(&this->visited[this->hashSlot(key)]);
+#endif
+}
+
+bool StateExplorer::markVisited(uint64_t key)
+{
+	size_t mask = this->visited.size() - 1;
+
+	// linear probing, a slot is claimed with a compare and swap so no lock is needed
+	size_t slot = this->hashSlot(key);
+	for (size_t probes = 0; probes <= mask; probes++)
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new BananaFilling(((Poptart_Dispenser*)this->CurrentContext)->DispensedItem);
+		uint64_t found = this->visited[slot].load(memory_order_relaxed);
+		if (found == 0 && this->visited[slot].compare_exchange_strong(found, key, memory_order_relaxed)) return true;
+		if (found == key) return false;	// if another worker claimed the slot first it may have added the same key
+		slot = (slot + 1) & mask;
 	}
-	if (option & 128)
+
+	this->tableFull.store(true);
+	return false;
+}
+
+// only called between levels, while no worker is adding to the set
+void StateExplorer::reserve(size_t configurations)
+{
+	size_t size = this->visited.size();
+	size_t limit = (size_t)1 << this->bounds.tableBits;
+	while (size < configurations * 2 && size < limit) size *= 2;
+	if (size == this->visited.size()) return;
+
+	vector<atomic<uint64_t>> grown(size);
+	this->visited.swap(grown);
+	for (size_t i = 0; i < grown.size(); i++)
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new StrawberryFilling(((Poptart_Dispenser*)this->CurrentContext)->DispensedItem);
+		uint64_t key = grown[i].load(memory_order_relaxed);
+		if (key != 0) this->markVisited(key);
 	}
-	if (option & 256)
+}
+
+uint64_t StateExplorer::step(Poptart_Dispenser& dispenser, ExplorerPoptart& loaded, bool& loadedDeleted, const ExplorerConfig& from, dispenserEvent type, int choice, int& broken)
+{
+	// LOAD
+	// the poptart selected is the worker's stand in for the poptart built for the option, if the customer
+	// has already collected it the dispenser only keeps a pointer to it and must never delete it
+	dispenser.setState((state)from.stateIndex);
+	dispenser.setStateParam(Credit, from.credit);
+	dispenser.setStateParam(No_Of_Poptarts, from.poptarts);
+	dispenser.itemDispensed = from.itemDispensed;
+	dispenser.itemRetrieved = from.itemRetrieved;
+	dispenser.quotedPrices = this->prices;
+	dispenser.DispensedItem = nullptr;
+	if (from.selection > 0)
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new RaspberryFilling(((Poptart_Dispenser*)this->CurrentContext)->DispensedItem);
+		loaded.poptart = this->selections[from.selection - 1];
+		dispenser.DispensedItem = &loaded;
 	}
-	if (option & 512)
+	bool collected = from.selection > 0 && from.itemRetrieved;
+
+	// APPLY
+	bool accepted = false;
+	Product* returned = nullptr;
+	switch (type)
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new AppleFilling(((Poptart_Dispenser*)this->CurrentContext)->DispensedItem);
+	case Insert_Money: accepted = dispenser.insertMoney(this->bounds.money[choice]); break;
+	case Make_Selection: accepted = dispenser.makeSelection(this->bounds.options[choice]); break;
+	case Money_Rejected: accepted = dispenser.moneyRejected(); break;
+	case Add_Poptart: accepted = dispenser.addPoptart(this->bounds.restock[choice]); break;
+	case Dispense: accepted = dispenser.dispense(); break;
+	case Get_Product: returned = dispenser.getProduct(); break;
 	}
-	if (option & 1024)
+
+	// READ BACK
+	ExplorerConfig to;
+	to.stateIndex = dispenser.getStateIndex();
+	to.credit = dispenser.getStateParam(Credit);
+	to.poptarts = dispenser.getStateParam(No_Of_Poptarts);
+	to.itemDispensed = dispenser.itemDispensed;
+	to.itemRetrieved = dispenser.itemRetrieved;
+	if (dispenser.DispensedItem == nullptr) to.selection = 0;
+	else if (type == Make_Selection && accepted) to.selection = choice + 1;
+	else to.selection = from.selection;
+
+	broken = 0;
+	if (to.credit < 0) broken |= 1 << Negative_Credit;
+	if (to.poptarts < 0) broken |= 1 << Negative_Stock;
+	if (to.stateIndex == Dispenses_Poptart && to.selection == 0) broken |= 1 << Dispensing_Nothing;
+	if (collected && loadedDeleted) broken |= 1 << Collected_Poptart_Deleted;
+	else if (collected && dispenser.DispensedItem == &loaded && !dispenser.itemRetrieved) broken |= 1 << Collected_Poptart_Reclaimed;	// the dispenser would delete it later
+
+	// CLEAN UP
+	// deletes each poptart the dispenser built during this step once, whoever owns it now
+	Product* leftovers[2] = { returned, dispenser.itemRetrieved ? nullptr : dispenser.DispensedItem };
+	if (leftovers[1] == leftovers[0]) leftovers[1] = nullptr;
+	for (int i = 0; i < 2; i++)
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new BlackberryFilling(((Poptart_Dispenser*)this->CurrentContext)->DispensedItem);
+		if (leftovers[i] != &loaded) delete leftovers[i];
 	}
-	if (option & 2048)
+	if (loadedDeleted)	// the stand in is rebuilt in place so it can be loaded again
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new MapleFilling(((Poptart_Dispenser*)this->CurrentContext)->DispensedItem);
+		loadedDeleted = false;
+		new (&loaded) ExplorerPoptart(&loadedDeleted);
 	}
-	if (option & 4096)
+	dispenser.DispensedItem = nullptr;
+	dispenser.itemRetrieved = true;
+
+	return this->encode(to);
+}
+
+void StateExplorer::expand(Poptart_Dispenser& dispenser, ExplorerPoptart& loaded, bool& loadedDeleted, uint64_t key, vector<uint64_t>& candidates, ExplorerTally& tally)
+{
+	ExplorerConfig from = this->decode(key);
+	tally.reached[this->shape(from)] = true;
+
+	// every event is tried with every argument in its domain
+	const pair<dispenserEvent, int> events[] = {
+		{ Insert_Money, (int)this->bounds.money.size() },
+		{ Make_Selection, (int)this->bounds.options.size() },
+		{ Money_Rejected, 1 },
+		{ Add_Poptart, (int)this->bounds.restock.size() },
+		{ Dispense, 1 },
+		{ Get_Product, 1 }
+	};
+
+	bool deadEnd = true;
+	for (int e = 0; e < 6; e++)
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new MarshmellowFilling(((Poptart_Dispenser*)this->CurrentContext)->DispensedItem);
+		for (int choice = 0; choice < events[e].second; choice++)
+		{
+			int broken = 0;
+			uint64_t to = this->step(dispenser, loaded, loadedDeleted, from, events[e].first, choice, broken);
+			tally.transitions++;
+			if (to != key) deadEnd = false;
+			else if (broken == 0) continue;	// most events are rejected and lead back to 'key', so the visited set isn't checked
+
+			// an event breaking an invariant is recorded even if it leads somewhere already found
+			// but where it leads isn't explored further
+			if (broken != 0)
+			{
+				for (int check = 0; check < Invariant_Count; check++)
+				{
+					if (!(broken & (1 << check))) continue;
+					if (tally.violations[check]++ == 0)
+					{
+						tally.violationExamples[check] = key;
+						tally.violationEvents[check] = events[e].first;
+					}
+				}
+				continue;
+			}
+			if (this->decode(to).credit > this->bounds.maxCredit)
+			{
+				tally.clipped++;
+				continue;
+			}
+			candidates.push_back(to);
+		}
 	}
-	if (option & 8192)
+
+	if (deadEnd && tally.deadEnds++ == 0) tally.deadEndExample = key;
+}
+
+bool StateExplorer::explore(void)
+{
+	auto started = chrono::steady_clock::now();
+	size_t eventCount = this->bounds.money.size() + this->bounds.options.size() + this->bounds.restock.size() + 3;	// events tried from each configuration
+
+	vector<uint64_t> frontier;
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new CheeseFilling(((Poptart_Dispenser*)this->CurrentContext)->DispensedItem);
+		Poptart_Dispenser dispenser(this->bounds.startingStock);
+		ExplorerConfig start = { dispenser.getStateIndex(), dispenser.getStateParam(Credit), dispenser.getStateParam(No_Of_Poptarts), 0, false, false };
+		frontier.push_back(this->encode(start));
+		this->markVisited(frontier[0]);
 	}
-	if (option & 16384)
+	this->visitedCount = 1;
+
+	mutex mergeLock;	// protects the next frontier and the totals while a worker adds its results
+	while (!frontier.empty() && !this->tableFull.load())
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new CheeseAndHamFilling(((Poptart_Dispenser*)this->CurrentContext)->DispensedItem);
+		// the set grows before each level so it can hold everything the level could find
+		this->reserve(this->visitedCount + frontier.size() * eventCount);
+
+		vector<uint64_t> next;
+		parallelFor(frontier.size(), [&](size_t begin, size_t end)
+		{
+			ostream discard(nullptr);	// a stream without a buffer ignores output, each worker has its own
+			Poptart_Dispenser dispenser(0);
+			dispenser.setOutput(&discard);
+			dispenser.setPriceBoard(&this->board);
+			bool loadedDeleted = false;
+			ExplorerPoptart loaded(&loadedDeleted);
+			ExplorerTally tally;
+			vector<uint64_t> candidates;
+			vector<uint64_t> found;
+			for (size_t i = begin; i < end; i++) this->expand(dispenser, loaded, loadedDeleted, frontier[i], candidates, tally);
+
+			// the visited set is far bigger than the cache, so the slot for each candidate
+			// is loaded a few candidates ahead of checking it
+			for (size_t i = 0; i < candidates.size(); i++)
+			{
+				if (i + Prefetch_Distance < candidates.size()) this->prefetch(candidates[i + Prefetch_Distance]);
+				if (this->markVisited(candidates[i])) found.push_back(candidates[i]);	// if it has been found before it has already been (or will be) expanded
+			}
+
+			lock_guard<mutex> lock(mergeLock);
+			next.insert(next.end(), found.begin(), found.end());
+			this->totals.transitions += tally.transitions;
+			this->totals.clipped += tally.clipped;
+			if (this->totals.deadEnds == 0) this->totals.deadEndExample = tally.deadEndExample;
+			this->totals.deadEnds += tally.deadEnds;
+			for (int check = 0; check < Invariant_Count; check++)
+			{
+				if (this->totals.violations[check] == 0)
+				{
+					this->totals.violationExamples[check] = tally.violationExamples[check];
+					this->totals.violationEvents[check] = tally.violationEvents[check];
+				}
+				this->totals.violations[check] += tally.violations[check];
+			}
+			for (int i = 0; i < Shape_Count; i++) this->totals.reached[i] = this->totals.reached[i] || tally.reached[i];
+		});
+
+		this->depth++;
+		this->visitedCount += next.size();
+		frontier.swap(next);
 	}
-	if (option & 32768)
+
+	long long violations = 0;
+	for (int check = 0; check < Invariant_Count; check++) violations += this->totals.violations[check];
+
+	this->seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+	if (this->tableFull.load()) cout << "Error! Visited set is full, increase 'tableBits'!" << endl;
+	return violations == 0 && !this->tableFull.load();
+}
+
+void StateExplorer::report(ostream& out)
+{
+	static const char* stateNames[] = { "Out_Of_Poptart", "No_Credit", "Has_Credit", "Dispenses_Poptart" };
+	static const char* callNames[] = { "insertMoney", "makeSelection", "moneyRejected", "addPoptart", "dispense", "getProduct" };
+	static const char* invariantNames[] = { "Negative_Credit", "Negative_Stock", "Dispensing_Nothing", "Collected_Poptart_Deleted", "Collected_Poptart_Reclaimed" };
+
+	out << "Explored " << this->visitedCount << " configurations over " << this->depth << " levels" << endl;
+	out << "Applied " << this->totals.transitions << " events in " << this->seconds << "s ("
+		<< (long long)(this->totals.transitions / max(this->seconds, 1e-9)) << " per second)" << endl;
+	if (this->totals.clipped > 0) out << "Events leading past the credit bound: " << this->totals.clipped << endl;
+
+	// UNREACHABLE
+	// every combination of state, selection, dispensed and retrieved that no event led to
+	out << "Unreachable:" << endl;
+	for (int i = 0; i < Shape_Count; i++)
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new CaramelFilling(((Poptart_Dispenser*)this->CurrentContext)->DispensedItem);
+		if (this->totals.reached[i]) continue;
+		out << "  " << stateNames[i / 8] << ((i & 4) ? " selected" : " nothing selected")
+			<< ((i & 2) ? " dispensed" : "") << ((i & 1) ? " collected" : "") << endl;
 	}
-	if (option & 65536)
+
+	out << "Dead ends: " << this->totals.deadEnds;
+	if (this->totals.deadEnds > 0) out << " e.g. " << this->describe(this->totals.deadEndExample);
+	out << endl;
+
+	out << "Invariant violations:" << endl;
+	for (int check = 0; check < Invariant_Count; check++)
 	{
-		((Poptart_Dispenser*)this->CurrentContext)->DispensedItem = new VanillaFilling(((Poptart_Dispenser*)this->CurrentContext)->DispensedItem);
+		out << "  " << invariantNames[check] << ": " << this->totals.violations[check];
+		if (this->totals.violations[check] > 0)
+		{
+			out << " e.g. " << callNames[this->totals.violationEvents[check]] << " from " << this->describe(this->totals.violationExamples[check]);
+		}
+		out << endl;
 	}
-	
-	((Poptart_Dispenser*)this->CurrentContext)->itemRetrieved = false;	// sets 'itemRetrieved' to false meaning that the poptart is ready to be retrieved from the dispenser
-	this->CurrentContext->setState(Dispenses_Poptart);	// changes state to 'Dispenses_Poptart'
-	return true;	// returns true meaning no errors
 }
 
-// if moneyRejected is called in the 'HasCredit' state
-// then 
-bool HasCredit::moneyRejected(void)
+long long StateExplorer::getVisitedCount(void)
 {
-	cout << "Credit rejected!" << endl;
-	this->CurrentContext->setStateParam(Credit, 0);	// sets the 'money' into the 'setStateParam' vector to 0 using index 'Credit'
-	this->CurrentContext->setState(No_Credit);	// changes state to 'No_Credit'
-	return true;	// returns true meaning no errors
+	return this->visitedCount;
 }
 
-// Cannot add poptarts as dispenser already contains poptarts
-bool HasCredit::addPoptart(int number)
+long long StateExplorer::getTransitionCount(void)
 {
-	cout << "Error! Dispenser already contains poptarts!" << endl;
-	return false;	// returns false meaning an unexpected error has occurred
+	return this->totals.transitions;
 }
 
-
-// Cannot dispense as user hasn't selected a poptart to be dispensed
-bool HasCredit::dispense(void)
+long long StateExplorer::getDeadEndCount(void)
 {
-	cout << "Error! Please select poptart!" << endl;
-	return false;	// returns false meaning an unexpected error has occurred
+	return this->totals.deadEnds;
 }
 
-// DispensesPoptart State
-// Cannot insertMoney as dispenser is preparing
-// to dispense poptart
-bool DispensesPoptart::insertMoney(int money)
+long long StateExplorer::getViolationCount(invariant check)
 {
-	cout << "Error! Already dispensing poptart!" << endl;
-	return false;	// returns false meaning an unexpected error has occurred
+	return this->totals.violations[check];
 }
 
+// CHECKS
+// small checks for each feature, run with the 'check' argument so changes can be gated on them
+// each check says what went wrong and returns false if the feature doesn't behave as described
 
-// Cannot makeSelection as user has already selected a poptart
-// to be dispensed
-bool DispensesPoptart::makeSelection(int option)
+// prints 'what' as an error if 'condition' is false, returns 'condition'
+bool expect(bool condition, const string& what)
 {
-	cout << "Error! Already dispensing poptart!" << endl;
-	return false;	// returns false meaning an unexpected error has occurred
+	if (!condition) cerr << "Error! " << what << endl;
+	return condition;
 }
 
-
-// Cannot reject credit as dispenser is preparing
-// to dispense poptart
-bool DispensesPoptart::moneyRejected(void)
+// writes records through the 'TraceWriter', reads them back and checks every single bit flip is caught
+bool checkTraceFormat(void)
 {
-	cout << "Error! Already dispensing poptart!" << endl;
-	return false;	// returns false meaning an unexpected error has occurred
+	bool passed = true;
+
+	// a realistic mix of events from a few dispensers, a few microseconds apart
+	vector<DispenserRecord> written;
+	mt19937 random(7);
+	int64_t timestamp = 1700000000000000LL;
+	for (int i = 0; i < 200000; i++)
+	{
+		DispenserRecord record;
+		record.dispenserId = 100 + random() % 4;
+		record.timestamp = timestamp += random() % 5000;
+		record.type = (dispenserEvent)(random() % (Get_Product + 1));
+		record.argument = record.type == Insert_Money ? 50 * (int)(random() % 4) : 0;
+		record.accepted = random() % 4 != 0;
+		record.stateIndex = random() % (Dispenses_Poptart + 1);
+		written.push_back(record);
+	}
+
+	stringstream file(ios::in | ios::out | ios::binary);
+	{
+		TraceWriter writer(file);
+		for (int i = 0; i < (int)written.size(); i++) writer.onEvent(written[i]);
+	}
+	string bytes = file.str();
+
+	auto started = chrono::steady_clock::now();
+	vector<DispenserRecord> read;
+	TraceReader reader(file);
+	passed &= expect(reader.isValid() && reader.readAll(read), "trace could not be read back");
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+	passed &= expect(read.size() == written.size(), "trace has the wrong number of records");
+	for (int i = 0; passed && i < (int)written.size(); i++)
+	{
+		const DispenserRecord& a = written[i];
+		const DispenserRecord& b = read[i];
+		passed &= expect(a.dispenserId == b.dispenserId && a.timestamp == b.timestamp && a.type == b.type
+			&& a.argument == b.argument && a.accepted == b.accepted && a.stateIndex == b.stateIndex, "record " + to_string(i) + " changed");
+	}
+	cout << "  " << (double)bytes.size() / written.size() << " bytes per record, "
+		<< (long long)(written.size() / max(seconds, 1e-9)) << " records read per second" << endl;
+
+	// any single damaged bit in a small trace must make it unreadable rather than change what is read
+	stringstream small(ios::in | ios::out | ios::binary);
+	{
+		TraceWriter writer(small, 16);
+		for (int i = 0; i < 48; i++) writer.onEvent(written[i]);
+	}
+	string original = small.str();
+	int missed = 0;
+	for (size_t bit = 0; bit < original.size() * 8; bit++)
+	{
+		string damaged = original;
+		damaged[bit / 8] ^= (char)(1 << (bit % 8));
+		stringstream damagedFile(damaged, ios::in | ios::binary);
+		TraceReader damagedReader(damagedFile);
+		vector<DispenserRecord> records;
+		if (damagedReader.isValid() && damagedReader.readAll(records)) missed++;
+	}
+	passed &= expect(missed == 0, to_string(missed) + " damaged bits were not detected");
+
+	// a damaged size in the footer or a block header mustn't be trusted to allocate
+	string huge = original;
+	huge[huge.size() - 9] = (char)0xFF;	// top byte of the block count
+	stringstream hugeFile(huge, ios::in | ios::binary);
+	passed &= expect(!TraceReader(hugeFile).isValid(), "a damaged block count was trusted");
+	huge = original;
+	huge[5 + 7] = (char)0x7F;	// top byte of the first block's payload size
+	stringstream hugeBlock(huge, ios::in | ios::binary);
+	TraceReader hugeReader(hugeBlock);
+	vector<DispenserRecord> records;
+	passed &= expect(hugeReader.isValid() && !hugeReader.readBlock(0, records) && records.empty(), "a damaged payload size was trusted");
+
+	// a trace too short to hold a block, whose only index entry points into the index itself
+	// where its timestamp reads as a block header with a huge payload
+	vector<unsigned char> entry;
+	putFixed(entry, 13, 8);						// offset, 8 bytes into this entry
+	putFixed(entry, Trace_Block_Magic, 4);		// timestamp, read back as the block magic
+	putFixed(entry, 0x7FFFFFF0, 4);				// and the payload size
+	putFixed(entry, 0, 4);						// record count
+	vector<unsigned char> tiny;
+	putFixed(tiny, Trace_File_Magic, 4);
+	tiny.push_back(Trace_Version);
+	tiny.insert(tiny.end(), entry.begin(), entry.end());
+	putFixed(tiny, 5, 8);						// index offset
+	putFixed(tiny, 1, 4);						// block count
+	putFixed(tiny, traceChecksum(entry.data(), entry.size()), 4);
+	putFixed(tiny, Trace_Index_Magic, 4);
+	stringstream tinyFile(string(tiny.begin(), tiny.end()), ios::in | ios::binary);
+	TraceReader tinyReader(tinyFile);
+	records.clear();
+	passed &= expect(!tinyReader.isValid() || !tinyReader.readBlock(0, records), "a block in a " + to_string(tiny.size()) + " byte trace was read past its index");
+
+	// a block whose payload runs on into the index, with its checksum made to match, is still damaged
+	stringstream overlapping(ios::in | ios::out | ios::binary);
+	{
+		TraceWriter writer(overlapping, 16);
+		for (int i = 0; i < 8; i++) writer.onEvent(written[i]);
+	}
+	string overlap = overlapping.str();
+	vector<unsigned char> block(overlap.begin() + 5, overlap.end());
+	uint32_t payloadSize = (uint32_t)getFixed(block.data() + 4, 4) + 8;
+	for (int i = 0; i < 4; i++) overlap[5 + 4 + i] = (char)(payloadSize >> (8 * i));
+	block.assign(overlap.begin() + 5, overlap.end());
+	uint32_t checksum = traceChecksum(block.data() + 4, Trace_Block_Header_Size - 8);
+	checksum = traceChecksum(block.data() + Trace_Block_Header_Size, payloadSize, checksum);
+	for (int i = 0; i < 4; i++) overlap[5 + 24 + i] = (char)(checksum >> (8 * i));
+	stringstream overlapFile(overlap, ios::in | ios::binary);
+	TraceReader overlapReader(overlapFile);
+	records.clear();
+	passed &= expect(overlapReader.isValid() && !overlapReader.readBlock(0, records), "a block running into the index was read");
+
+	return passed;
 }
 
+// serves three customers through a pipelined dispenser and checks each one is traced in a session of their own
+bool checkSessionTracing(void)
+{
+	bool passed = true;
+	ostream discard(nullptr);	// the dispenser's messages aren't needed
+	SessionTracer tracer(1);
+	Poptart_Dispenser dispenser(10);
+	dispenser.setOutput(&discard);
+	dispenser.setDispenserId(31);
+	dispenser.setPipelineDepth(2);
+	dispenser.setSessionTracer(&tracer);
+
+	dispenser.insertMoney(200);			// first customer
+	dispenser.makeSelection(PlainBase::optionCode);
+	dispenser.insertMoney(200);			// second customer orders while the first poptart is being dispensed
+	dispenser.makeSelection(PlainBase::optionCode);
+	dispenser.insertMoney(200);			// third customer pays but hasn't chosen yet
+	dispenser.dispense();
+	delete dispenser.getProduct();		// first customer leaves, the second order is served
+	dispenser.dispense();
+	delete dispenser.getProduct();		// second customer leaves, the third customer is served
+	dispenser.makeSelection(PlainBase::optionCode);
+	dispenser.dispense();
+	delete dispenser.getProduct();
+
+	// every span is written on its own line, the session it belongs to is its 'tid'
+	stringstream json;
+	tracer.exportJson(json);
+	map<string, vector<string>> sessionsByName;
+	string line;
+	while (getline(json, line))
+	{
+		size_t name = line.find("\"name\":\"");
+		size_t tid = line.find("\"tid\":");
+		if (name == string::npos || tid == string::npos) continue;
+		name += 8;
+		tid += 6;
+		sessionsByName[line.substr(name, line.find('"', name) - name)].push_back(line.substr(tid, line.find_first_of(",}", tid) - tid));
+	}
+
+	vector<string>& sessions = sessionsByName["session"];
+	passed &= expect(sessions.size() == 3, "expected 3 sessions, traced " + to_string(sessions.size()));
+	sort(sessions.begin(), sessions.end());
+	passed &= expect(unique(sessions.begin(), sessions.end()) == sessions.end(), "two customers shared a session");
+
+	// each customer's dispense and collection happen in their own session
+	vector<string> dispenses = sessionsByName["dispense"];
+	vector<string> collections = sessionsByName["getProduct"];
+	sort(dispenses.begin(), dispenses.end());
+	sort(collections.begin(), collections.end());
+	passed &= expect(dispenses == sessions, "a dispense wasn't traced in its customer's session");
+	passed &= expect(collections == sessions, "a collection wasn't traced in its customer's session");
+	return passed;
+}
 
-// Cannot addPoptart as dispenser is already
-// dispensing poptart
-bool DispensesPoptart::addPoptart(int number)
+// dispenses through a simulated actuator and checks completions, failures and deleting either side mid-dispense
+bool checkActuator(void)
 {
-	cout << "Error! Already dispensing poptart!" << endl;
-	return false;	// returns false meaning an unexpected error has occurred
+	bool passed = true;
+	ostream discard(nullptr);	// the dispensers' messages aren't needed
+	DispenseReactor reactor;
+	SimulatedActuator* working = new SimulatedActuator(reactor, 1, 0.0);
+	SimulatedActuator broken(reactor, 1, 1.0);
+
+	// notes whether each dispense reported to the listeners took a poptart
+	struct DispenseLog : public DispenserListener
+	{
+		vector<bool> dispensed;
+		void onEvent(const DispenserRecord& record)
+		{
+			if (record.type == Dispense) this->dispensed.push_back(record.accepted);
+		}
+	};
+
+	// the poptart only leaves the dispenser once the completion is delivered
+	// and asking again while the actuator is busy is rejected and reported straight away
+	DispenseLog log;
+	Poptart_Dispenser dispenser(10);
+	dispenser.setOutput(&discard);
+	dispenser.setActuator(working);
+	dispenser.addListener(&log);
+	dispenser.insertMoney(200);
+	dispenser.makeSelection(PlainBase::optionCode);
+	dispenser.dispense();
+	dispenser.dispense();
+	passed &= expect(dispenser.getStateParam(No_Of_Poptarts) == 10, "the poptart was dispensed before the actuator finished");
+	passed &= expect(log.dispensed == vector<bool>{ false }, "the dispense asked for while the actuator was busy wasn't reported on its own");
+	passed &= expect(reactor.poll(1000) == 1, "the completion wasn't delivered");
+	passed &= expect(dispenser.getStateParam(No_Of_Poptarts) == 9, "the poptart wasn't dispensed once the actuator finished");
+	passed &= expect(log.dispensed == vector<bool>{ false, true }, "the completed dispense wasn't reported once");
+	dispenser.removeListener(&log);
+	Product* product = dispenser.getProduct();
+	passed &= expect(product != nullptr, "the dispensed poptart couldn't be collected");
+	delete product;
+
+	// a failed dispense keeps the customer's credit and stock
+	dispenser.setActuator(&broken);
+	dispenser.insertMoney(200);
+	dispenser.makeSelection(PlainBase::optionCode);
+	int credit = dispenser.getStateParam(Credit);
+	dispenser.dispense();
+	passed &= expect(reactor.poll(1000) == 1, "the failure wasn't delivered");
+	passed &= expect(dispenser.getStateParam(No_Of_Poptarts) == 9, "a failed dispense took a poptart");
+	passed &= expect(dispenser.getStateParam(Credit) == credit, "a failed dispense took the customer's credit");
+
+	// a dispenser deleted mid-dispense never receives its completion
+	Poptart_Dispenser* deleted = new Poptart_Dispenser(10);
+	deleted->setOutput(&discard);
+	deleted->setActuator(working);
+	deleted->insertMoney(200);
+	deleted->makeSelection(PlainBase::optionCode);
+	deleted->dispense();
+	delete deleted;
+	this_thread::sleep_for(chrono::milliseconds(5));
+	passed &= expect(reactor.poll(0) == 0, "a completion was delivered to a deleted dispenser");
+
+	// an actuator deleted mid-dispense fails the dispense and is no longer used
+	Poptart_Dispenser orphaned(10);
+	orphaned.setOutput(&discard);
+	orphaned.setActuator(working);
+	orphaned.insertMoney(200);
+	orphaned.makeSelection(PlainBase::optionCode);
+	orphaned.dispense();
+	delete working;
+	passed &= expect(orphaned.getStateParam(No_Of_Poptarts) == 10, "a dispense completed after its actuator was deleted");
+	passed &= expect(orphaned.getStateParam(Credit) == 200, "a dispense failed by its actuator took the customer's credit");
+	orphaned.makeSelection(PlainBase::optionCode);
+	orphaned.dispense();
+	passed &= expect(orphaned.getStateParam(No_Of_Poptarts) == 9, "the dispenser didn't dispense instantly once its actuator was deleted");
+	delete orphaned.getProduct();
+	this_thread::sleep_for(chrono::milliseconds(5));
+	passed &= expect(reactor.poll(0) == 0, "a completion was delivered from a deleted actuator");
+	return passed;
 }
 
-// 'Dispenses' poptart from the Poptart_Dispenser
-// takes away the cost of the poptart from the users
-// existing credit
-bool DispensesPoptart::dispense(void)
+// plans a small fleet and checks which dispensers are visited, in what order and how much each is loaded with
+bool checkRestockPlanner(void)
+{
+	bool passed = true;
+	RestockPlanner planner(24, 60);
+	vector<RestockSnapshot> fleet = {
+		{ 1, 1, 0, 40, 0 },		// empty and not selling, e.g. new
+		{ 2, 1, 40, 40, 0 },	// full and not selling
+		{ 3, 1, 10, 40, 1 },	// runs out in 10 hours
+		{ 4, 2, 30, 40, 10 },	// runs out in 3 hours
+		{ 5, 2, 30, 40, 0.5 }	// lasts past the horizon
+	};
+	vector<RoutePlan> routes = planner.plan(fleet);
+
+	passed &= expect(routes.size() == 2, "expected 2 routes, planned " + to_string(routes.size()));
+	if (routes.size() != 2) return false;
+	passed &= expect(routes[0].route == 1 && routes[0].priority == 1, "the route with an empty dispenser wasn't driven first");
+	passed &= expect(routes[0].stops.size() == 2, "expected 2 stops on route 1, planned " + to_string(routes[0].stops.size()));
+	passed &= expect(routes[0].stops[0].dispenserId == 1 && routes[0].stops[0].hoursUntilEmpty == 0, "the empty dispenser that isn't selling wasn't visited first");
+	passed &= expect(routes[0].stops[0].quantity == 40, "the empty dispenser that isn't selling wasn't filled up");
+	passed &= expect(routes[0].stops[1].dispenserId == 3 && routes[0].stops[1].quantity == 20 && routes[0].stops[1].shortfall == 4, "the truck on route 1 wasn't loaded up to its capacity");
+	passed &= expect(routes[1].stops.size() == 1 && routes[1].stops[0].dispenserId == 4 && routes[1].stops[0].quantity == 40, "route 2 should only visit dispenser 4");
+	return passed;
+}
+
+// drives a fleet of dispensers with random events and checks the index agrees with asking every dispenser
+bool checkFleetIndex(void)
 {
-	// checks to see if the user has enough credit to dispense the selected poptart
-	if (this->CurrentContext->getStateParam(Credit) >= this->CurrentContext->getStateParam(Cost_Of_Poptart))
+	bool passed = true;
+	ostream discard(nullptr);	// the dispensers' messages aren't needed
+	FleetIndex fleet(2);
+	vector<Poptart_Dispenser*> dispensers;
+	for (int i = 0; i < 100; i++)
 	{
-		// outputs the description of the currently dispensed poptart
-		cout << "Dispensing " << ((Poptart_Dispenser*)this->CurrentContext)->DispensedItem->description() << " Poptart.\n";
+		dispensers.push_back(new Poptart_Dispenser(i % 4));
+		dispensers[i]->setOutput(&discard);
+		dispensers[i]->joinFleet(&fleet);
+	}
+
+	mt19937 random(27);
+	for (int round = 0; round < 5; round++)
+	{
+		for (int i = 0; i < 2000; i++)
+		{
+			Poptart_Dispenser* dispenser = dispensers[random() % dispensers.size()];
+			switch (random() % 5)
+			{
+			case 0: dispenser->insertMoney(100); break;
+			case 1: dispenser->makeSelection(PlainBase::optionCode); break;
+			case 2: dispenser->moneyRejected(); break;
+			case 3: dispenser->addPoptart(1 + random() % 3); break;
+			case 4: dispenser->dispense(); delete dispenser->getProduct(); break;
+			}
+		}
+		delete dispensers.back();	// a deleted dispenser leaves the fleet
+		dispensers.pop_back();
+
+		int inState[Dispenses_Poptart + 1] = {};
+		int atStock[Normal_Stock + 1] = {};
+		for (int i = 0; i < (int)dispensers.size(); i++)
+		{
+			inState[dispensers[i]->getStateIndex()]++;
+			atStock[fleet.getStockLevel(dispensers[i]->getStateParam(No_Of_Poptarts))]++;
+		}
+		for (int i = 0; i <= Dispenses_Poptart; i++)
+		{
+			passed &= expect(fleet.countInState((state)i) == inState[i] && (int)fleet.inState((state)i).size() == inState[i],
+				"state " + to_string(i) + " has " + to_string(inState[i]) + " dispensers, the index has " + to_string(fleet.countInState((state)i)));
+		}
+		for (int i = 0; i <= Normal_Stock; i++)
+		{
+			passed &= expect(fleet.countAtStock((stockLevel)i) == atStock[i] && (int)fleet.atStock((stockLevel)i).size() == atStock[i],
+				"stock level " + to_string(i) + " has " + to_string(atStock[i]) + " dispensers, the index has " + to_string(fleet.countAtStock((stockLevel)i)));
+		}
+	}
 
-		// subtracts the cost of the poptart from the amount of credits available in the dispenser
-		this->CurrentContext->setStateParam(Credit, this->CurrentContext->getStateParam(Credit)
-			- this->CurrentContext->getStateParam(Cost_Of_Poptart));
+	for (int i = 0; i < (int)dispensers.size(); i++) delete dispensers[i];
+	for (int i = 0; i <= Dispenses_Poptart; i++) passed &= expect(fleet.countInState((state)i) == 0, "a deleted dispenser is still in the index");
+	return passed;
+}
 
-		// removes the dispensed poptart from the dispenser by subtracting 1 from the available amount stored
-		// in the 'stateParam' vector using index 'No_Of_Poptarts'
-		this->CurrentContext->setStateParam(No_Of_Poptarts, this->CurrentContext->getStateParam(No_Of_Poptarts) - 1);
+// queues orders behind a dispense and checks they are served first come first served and the queue is bounded
+bool checkPipeline(void)
+{
+	bool passed = true;
+	ostream discard(nullptr);	// the dispenser's messages aren't needed
+	Poptart_Dispenser dispenser(10);
+	dispenser.setOutput(&discard);
+	dispenser.setPipelineDepth(2);
 
-		// sets the bool value of itemDispensed to true indicating that the poptart has been dispensed
-		((Poptart_Dispenser*)this->CurrentContext)->itemDispensed = true;
-		
-		// displays remaining credits
-		cout << "Remaining credit: " << this->CurrentContext->getStateParam(Credit) << "." << endl;
+	PriceBoard board;
+	const int options[] = { PlainBase::optionCode, SpicyBase::optionCode, PlainBase::optionCode | ChocolateFilling::optionCode };
+	vector<string> expected;
+	for (int i = 0; i < 3; i++)
+	{
+		Product* item = decodeSelection(options[i], board.read());
+		expected.push_back(item->description());
+		delete item;
 	}
-	else // else if there's not enough credit to dispense poptart
+
+	dispenser.insertMoney(500);		// the first customer is served straight away
+	dispenser.makeSelection(options[0]);
+	for (int i = 1; i < 3; i++)		// the next two wait in the queue
 	{
-		cout << "Error! Not enough money" << endl;
+		passed &= expect(dispenser.insertMoney(500), "a waiting customer couldn't pay");
+		passed &= expect(dispenser.makeSelection(options[i]), "a waiting customer couldn't order");
 	}
+	passed &= expect(!dispenser.insertMoney(500), "a customer paid although the queue was full");
 
-	// if there's more than 1 credit left in the dispenser
-	// set the current state to 'Has_Credit'
-	if (this->CurrentContext->getStateParam(Credit) > 0)
+	vector<string> served;
+	for (int i = 0; i < 3; i++)
 	{
-		this->CurrentContext->setState(Has_Credit);
+		dispenser.dispense();
+		Product* item = dispenser.getProduct();
+		if (item == nullptr) break;
+		served.push_back(item->description());
+		delete item;
 	}
-	else // else if the user has no credits
+	passed &= expect(served == expected, "the orders weren't served in the order they were taken");
+	passed &= expect(dispenser.getStateParam(No_Of_Poptarts) == 7, "expected 7 poptarts left, have " + to_string(dispenser.getStateParam(No_Of_Poptarts)));
+	return passed;
+}
+
+// checks quoting, building and presets agree on every price, and a customer pays the price quoted when they chose
+bool checkPricing(void)
+{
+	bool passed = true;
+	PriceTable catalogue = PriceTable::catalogue();
+	int mismatches = 0;
+	for (int option = 0; option < (1 << PriceTable::Item_Count); option++)
 	{
-		// set current state to 'No_Credit'
-		this->CurrentContext->setState(No_Credit);
+		Product* item = decodeSelection(option, catalogue);
+		if (item != nullptr && item->cost() != catalogue.quote(option)) mismatches++;
+		delete item;
 	}
+	passed &= expect(mismatches == 0, to_string(mismatches) + " option codes were quoted a different price than they were built with");
+
+	// the same poptart costs the same whether it is sold as a preset or decoded from its option code
+	ostream discard(nullptr);	// the dispensers' messages aren't needed
+	PriceBoard board;
+	Poptart_Dispenser decoded(5);
+	Poptart_Dispenser preset(5);
+	decoded.setOutput(&discard);
+	preset.setOutput(&discard);
+	decoded.setPriceBoard(&board);
+	preset.setPriceBoard(&board);
+	preset.registerPreset(Recipe<PlainBase, BananaFilling, BlackberryFilling>::preset("Berry Banana"));
+	const int option = Recipe<PlainBase, BananaFilling, BlackberryFilling>::optionCode();
+	decoded.insertMoney(1000);
+	preset.insertMoney(1000);
+	decoded.makeSelection(option);
+	preset.makeSelection(option);
+
+	// prices published after choosing don't change what these customers pay
+	PriceTable promotion = board.read();
+	promotion.setPrice(PlainBase::optionCode, 1);
+	board.publish(promotion);
+	decoded.dispense();
+	preset.dispense();
+	Product* decodedItem = decoded.getProduct();
+	Product* presetItem = preset.getProduct();
+	passed &= expect(decoded.getStateParam(Credit) == 1000 - catalogue.quote(option), "the decoded poptart wasn't charged at the quoted price");
+	passed &= expect(preset.getStateParam(Credit) == 1000 - catalogue.quote(option), "the preset wasn't charged at the quoted price");
+	passed &= expect(presetItem != nullptr && decodedItem != nullptr && presetItem->description() == decodedItem->description(), "the preset isn't the poptart its option code selects");
+	passed &= expect(presetItem != nullptr && presetItem->cost() == catalogue.quote(option), "the collected preset doesn't cost what was charged");
+	delete decodedItem;
+	delete presetItem;
+
+	// the next customer pays the published price
+	int credit = preset.getStateParam(Credit);
+	preset.makeSelection(option);
+	preset.dispense();
+	delete preset.getProduct();
+	passed &= expect(credit - preset.getStateParam(Credit) == promotion.quote(option), "the next preset wasn't charged at the published price");
+	return passed;
+}
 
-	// if there are no poptarts left in the dispenser
-	// set the current state to 'Out_Of_Poptart'
-	if (this->CurrentContext->getStateParam(No_Of_Poptarts) == 0)
+// explores the state machine with a small stock and checks no invariant is broken and nothing is stuck
+bool checkStateExplorer(void)
+{
+	bool passed = true;
+	ExplorerBounds bounds;
+	bounds.startingStock = 2;
+	StateExplorer explorer(bounds);
+	passed &= expect(explorer.explore(), "the explorer found a broken invariant or ran out of space");
+	passed &= expect(explorer.getVisitedCount() > 1, "the explorer didn't leave the first configuration");
+	passed &= expect(explorer.getDeadEndCount() == 0, to_string(explorer.getDeadEndCount()) + " configurations have no way out");
+	if (!passed) explorer.report(cerr);
+	return passed;
+}
+
+// runs every check, returns true if they all pass
+bool runChecks(void)
+{
+	const pair<const char*, bool (*)(void)> checks[] = {
+		{ "fleet index", &checkFleetIndex },
+		{ "trace format", &checkTraceFormat },
+		{ "session tracing", &checkSessionTracing },
+		{ "pipeline", &checkPipeline },
+		{ "pricing", &checkPricing },
+		{ "actuator", &checkActuator },
+		{ "restock planner", &checkRestockPlanner },
+		{ "state explorer", &checkStateExplorer }
+	};
+
+	bool passed = true;
+	for (const auto& check : checks)
 	{
-		this->CurrentContext->setState(Out_Of_Poptart);
+		cout << check.first << endl;
+		bool result = check.second();
+		cout << (result ? "  passed" : "  FAILED") << endl;
+		passed &= result;
 	}
-	return true;
+	return passed;
 }
 
-int main(void)
+int main(int argc, char* argv[])
 {
+	// 'check' runs the checks for each feature instead of the demo and exits with 1 if any fail
+	if (argc > 1 && string(argv[1]) == "check") return runChecks() ? 0 : 1;
+
+	// 'explore' model checks the state machine instead of running the demo
+	// and exits with 1 if an invariant is broken, so changes to the states can be gated on it
+	if (argc > 1 && string(argv[1]) == "explore")
+	{
+		StateExplorer explorer{ ExplorerBounds() };
+		bool passed = explorer.explore();
+		explorer.report(cout);
+		return passed ? 0 : 1;
+	}
+
 	Poptart_Dispenser* MyPoptart = new Poptart_Dispenser(0);
+	MyPoptart->registerPreset(Recipe<PlainBase, BananaFilling, BlackberryFilling>::preset("Berry Banana"));
 
 	MyPoptart->addPoptart(2);
 	MyPoptart->insertMoney(5000);
 	MyPoptart->makeSelection(55555);
 	MyPoptart->dispense();
+	MyPoptart->makeSelection(1089);
+	MyPoptart->dispense();
 	return 0;
 }
\ No newline at end of file